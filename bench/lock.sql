@@ -0,0 +1,6 @@
+-- Backends queueing on a few advisory locks, waiting in Lock:advisory
+\set lockid random(1, 10)
+BEGIN;
+SELECT pg_advisory_xact_lock(:lockid);
+SELECT pg_sleep(0.01);
+END;
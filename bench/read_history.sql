@@ -0,0 +1 @@
+SELECT count(*) FROM pg_wait_sampling_history;
@@ -0,0 +1,204 @@
+#!/bin/bash
+
+# Benchmarks of pg_wait_sampling sampling and read paths.
+#
+# Starts a scratch cluster with the installed extension, keeps a number of
+# pgbench clients waiting and measures the collector and the readers under
+# them.  Scenarios, run in the given order (all by default):
+#	* waiters - number of waiting backends, WAITERS
+#	* history - size of history ring, HISTORY_SIZES
+#	* readers - number of concurrent readers of every view, READERS
+#	* periods - sampling periods in milliseconds, PERIODS
+# Every run prints one row:
+#	* cpu_us/tick - collector CPU time per probe, from /proc
+#	* probe_us/tick, probe_p99_us, missed - from collector stats
+#	* read_tps, read_ms - throughput and mean latency of readers
+#	* read_hwm_kb - peak memory of backend reading the whole view once
+#	* shmem_kb, history_kb, profile_kb, profile_entries - memory taken
+# Copyright (c) 2017, Postgres Professional
+
+set -eu
+
+BENCH_DIR=${BENCH_DIR:-/tmp/pg_wait_sampling_bench}
+BENCH_PORT=${BENCH_PORT:-55436}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-3}
+WAIT_SCRIPT=${WAIT_SCRIPT:-sleep}
+WAITERS=${WAITERS:-"100 1000 4000"}
+HISTORY_SIZES=${HISTORY_SIZES:-"10000 100000 1000000 10000000"}
+READERS=${READERS:-"1 4 16"}
+PERIODS=${PERIODS:-"1 10 100"}
+
+# pgbench may not handle more clients than that in one process
+CLIENTS_PER_PGBENCH=500
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+scenarios=${*:-"waiters history readers periods"}
+clk_tck=$(getconf CLK_TCK)
+export PGPORT=$BENCH_PORT PGDATABASE=postgres
+
+max() {
+	local m=0 v
+	for v in "$@"; do
+		if [ "$v" -gt "$m" ]; then m=$v; fi
+	done
+	echo $m
+}
+
+psql_value() {
+	psql -XAtq -c "$1"
+}
+
+set_guc() {
+	psql_value "ALTER SYSTEM SET pg_wait_sampling.$1 = '$2'" > /dev/null
+	psql_value "SELECT pg_reload_conf()" > /dev/null
+}
+
+reset_gucs() {
+	psql_value "ALTER SYSTEM RESET ALL" > /dev/null
+	psql_value "SELECT pg_reload_conf()" > /dev/null
+}
+
+# Summary CPU time of collector workers in clock ticks
+collector_cpu() {
+	local pid total=0
+	for pid in $(pgrep -f 'pg_wait_sampling collector'); do
+		total=$((total + $(awk '{ print $14 + $15 }' /proc/$pid/stat)))
+	done
+	echo $total
+}
+
+collector_stats() {
+	psql_value "SELECT ticks, probe_time_us, probe_p99_us, missed_ticks,
+					   shmem_bytes / 1024, history_bytes / 1024,
+					   profile_bytes / 1024, profile_entries
+				FROM pg_wait_sampling_get_collector_stats()"
+}
+
+# Start waiting clients in background, split among several pgbench
+start_waiters() {
+	local left=$1 n
+	waiter_pids=""
+	while [ "$left" -gt 0 ]; do
+		n=$((left < CLIENTS_PER_PGBENCH ? left : CLIENTS_PER_PGBENCH))
+		pgbench -n -c $n -j $(((n + 49) / 50)) -T $((WARMUP + DURATION + 2)) \
+			-f "$bench_dir/$WAIT_SCRIPT.sql" > /dev/null 2>&1 &
+		waiter_pids="$waiter_pids $!"
+		left=$((left - n))
+	done
+	sleep $WARMUP
+}
+
+stop_waiters() {
+	local pid
+	for pid in $waiter_pids; do
+		wait $pid || true
+	done
+}
+
+# Peak memory of backend reading the whole view once
+read_hwm() {
+	psql -XAtq <<EOF
+SELECT pg_backend_pid() AS bpid \gset
+SELECT count(*) FROM pg_wait_sampling_$1 \g /dev/null
+\setenv BPID :bpid
+\! awk '/VmHWM/ { print \$2 }' /proc/\$BPID/status
+EOF
+}
+
+# Measure one run of given waiters and readers of given view
+measure() {
+	local label=$1 nwaiters=$2 nreaders=$3 view=$4
+	local cpu0 cpu1 stats0 stats1 out tps=- lat=- hwm=-
+	local ticks0 probe0 ticks1 probe1 p99 missed0 missed1
+	local shmem history profile entries dticks
+
+	start_waiters $nwaiters
+
+	cpu0=$(collector_cpu)
+	stats0=$(collector_stats)
+	if [ "$nreaders" -gt 0 ]; then
+		out=$(pgbench -n -c $nreaders -j $nreaders -T $DURATION \
+				  -f "$bench_dir/read_$view.sql" 2>&1)
+		tps=$(echo "$out" | awk '/^tps/ { print $3; exit }')
+		lat=$(echo "$out" | awk '/^latency average/ { print $4 }')
+	else
+		sleep $DURATION
+	fi
+	cpu1=$(collector_cpu)
+	stats1=$(collector_stats)
+	if [ "$view" != "-" ]; then
+		hwm=$(read_hwm $view)
+	fi
+
+	stop_waiters
+
+	IFS='|' read ticks0 probe0 p99 missed0 shmem history profile entries <<< "$stats0"
+	IFS='|' read ticks1 probe1 p99 missed1 shmem history profile entries <<< "$stats1"
+	dticks=$(max 1 $((ticks1 - ticks0)))
+
+	printf "%-20s %8s %8s %-8s %12s %14s %13s %7s %10s %8s %12s %9s %11s %11s %16s\n" \
+		"$label" $nwaiters $nreaders $view \
+		$(((cpu1 - cpu0) * 1000000 / clk_tck / dticks)) \
+		$(((probe1 - probe0) / dticks)) $p99 $((missed1 - missed0)) \
+		"$tps" "$lat" "$hwm" $shmem $history $profile $entries
+}
+
+print_header() {
+	printf "%-20s %8s %8s %-8s %12s %14s %13s %7s %10s %8s %12s %9s %11s %11s %16s\n" \
+		scenario waiters readers view cpu_us/tick probe_us/tick probe_p99_us \
+		missed read_tps read_ms read_hwm_kb shmem_kb history_kb profile_kb \
+		profile_entries
+}
+
+# Prepare a scratch cluster large enough for all the clients
+max_clients=$(($(max $WAITERS) + 3 * $(max $READERS) + 20))
+if [ ! -d "$BENCH_DIR/data" ]; then
+	initdb -D "$BENCH_DIR/data" > "$BENCH_DIR.initdb.log"
+fi
+pg_ctl -D "$BENCH_DIR/data" -l "$BENCH_DIR.log" -w \
+	-o "-c port=$BENCH_PORT -c max_connections=$max_clients \
+		-c shared_preload_libraries=pg_wait_sampling" start > /dev/null
+trap 'pg_ctl -D "$BENCH_DIR/data" -m fast -w stop > /dev/null' EXIT
+psql_value "CREATE EXTENSION IF NOT EXISTS pg_wait_sampling" > /dev/null 2>&1
+reset_gucs
+
+print_header
+for scenario in $scenarios; do
+	case $scenario in
+		waiters)
+			for n in $WAITERS; do
+				measure "waiters" $n 0 -
+			done
+			;;
+		history)
+			n=$(max $WAITERS)
+			for size in $HISTORY_SIZES; do
+				set_guc history_size $size
+				measure "history_size=$size" $n 1 history
+			done
+			reset_gucs
+			;;
+		readers)
+			n=$(max $WAITERS)
+			for view in current profile history; do
+				for r in $READERS; do
+					measure "readers" $n $r $view
+				done
+			done
+			;;
+		periods)
+			n=$(max $WAITERS)
+			for period in $PERIODS; do
+				set_guc profile_period $period
+				set_guc history_period $period
+				measure "period=${period}ms" $n 0 -
+			done
+			reset_gucs
+			;;
+		*)
+			echo "unknown scenario \"$scenario\"" >&2
+			exit 1
+			;;
+	esac
+done
@@ -0,0 +1,2 @@
+-- Backend waiting in Timeout:PgSleep most of the time
+SELECT pg_sleep(1);
@@ -10,16 +10,16 @@
 #include "postgres.h"
 
 #include "catalog/pg_type.h"
-#if PG_VERSION_NUM >= 130000
-#include "common/hashfn.h"
-#endif
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "postmaster/bgworker.h"
+#include "storage/dsm.h"
 #include "storage/ipc.h"
+#include "storage/lock.h"
+#include "storage/pmsignal.h"
 #include "storage/procarray.h"
 #include "storage/procsignal.h"
-#include "storage/shm_mq.h"
 #include "storage/shm_toc.h"
 #include "storage/spin.h"
 #include "utils/memutils.h"
@@ -31,13 +31,20 @@
 
 static volatile sig_atomic_t shutdown_requested = false;
 
+/* Shard of PGPROCs sampled by this collector */
+static int shard_no = 0;
+static int shard_count = 1;
+static CollectorShard *shard = NULL;
+
 static void handle_sigterm(SIGNAL_ARGS);
+static int64 monotonic_us(void);
+static uint8 proc_backend_type(int procno);
 
 /*
- * Register background worker for collecting waits history.
+ * Register background worker for collecting waits history of given shard.
  */
 void
-pgws_register_wait_collector(void)
+pgws_register_wait_collector(int shardno)
 {
 	BackgroundWorker worker;
 
@@ -49,65 +56,219 @@ pgws_register_wait_collector(void)
 	worker.bgw_notify_pid = 0;
 	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_wait_sampling");
 	snprintf(worker.bgw_function_name, BGW_MAXLEN, CppAsString(pgws_collector_main));
-	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_wait_sampling collector");
-	worker.bgw_main_arg = (Datum) 0;
+	if (shardno == 0)
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_wait_sampling collector");
+	else
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_wait_sampling collector %d",
+				 shardno);
+	worker.bgw_main_arg = Int32GetDatum(shardno);
 	RegisterBackgroundWorker(&worker);
 }
 
 /*
- * Allocate memory for waits history.
+ * Collector's handle of the waits history ring.
+ */
+typedef struct
+{
+	dsm_segment	   *segment;	/* NULL if the ring is in shared memory */
+	HistoryRing	   *ring;
+	HistoryBatch   *batch;		/* samples of the current probe */
+	uint64			base;		/* bytes written to replaced rings, but not
+								 * moved to this one */
+
+	/* Ring being filled by pending resize, if any */
+	dsm_segment	   *newSegment;
+	HistoryRing	   *newRing;
+	uint64			copyPos;	/* position in ring to copy from */
+	uint64			copyHead;	/* head of ring at the previous chunk */
+} History;
+
+/*
+ * Dense list of PGPROC numbers used for sampling without ProcArrayLock.
+ */
+typedef struct
+{
+	int			   *procnos;
+	int				count;
+	TimestampTz		refresh_ts;
+} ActiveProcs;
+
+/*
+ * Wait which a process was seen in since start_ts.  wait_event_info is 0 if
+ * the process wasn't waiting on the last probe.  For heavyweight lock waits
+ * the lock and its blocker are resolved once per wait.
+ */
+typedef struct
+{
+	int				pid;
+	uint32			wait_event_info;
+	uint64			queryId;
+	TimestampTz		start_ts;
+	bool			lockResolved;
+	uint32			blockerPid;
+	LOCKTAG			locktag;
+} ProcWait;
+
+/*
+ * State of PGPROC read by the current probe.  Probes copy PGPROCs first, and
+ * account the samples afterwards, so that neither ProcArrayLock nor the
+ * aggregate lock of shards is held longer than needed.
+ */
+typedef struct
+{
+	int				procno;
+	bool			waiting;
+	HistoryItem		item;
+	ProfileItem		key;		/* profile key, if profile is written */
+} ProcSample;
+
+/* Shortest sampling period in microseconds */
+#define MIN_SAMPLING_PERIOD_US		100
+
+/* How much of waits history is moved to the resized ring per probe */
+#define HISTORY_RESIZE_CHUNK		(256 * 1024)
+
+/* How often the list of live processes is rebuilt, in milliseconds */
+#define ACTIVE_PROCS_REFRESH_MS		1000
+
+/* How often the map of pids to PGPROCs is rebuilt, in milliseconds */
+#define PID_MAP_REFRESH_MS			1000
+
+#define IS_LOCK_WAIT(wait_event_info) \
+	(((wait_event_info) & 0xFF000000) == PG_WAIT_LOCK)
+
+/* Time of the last rebuild of pid map */
+static TimestampTz pid_map_ts = 0;
+
+/* Time of the last lookup of lock blockers */
+static TimestampTz blockers_ts = 0;
+static MemoryContext blockers_context = NULL;
+
+/*
+ * Capacity of the history ring in bytes.  pg_wait_sampling.history_size
+ * gives the memory of that many plain samples without lock details, while
+ * compact encoding fits several times more samples there.
+ */
+static Size
+history_capacity(int historySize)
+{
+	return (Size) historySize * offsetof(HistoryItem, hasLockInfo);
+}
+
+/*
+ * Create DSM segment for waits history ring, unless the ring is
+ * preallocated in shared memory.
  */
 static void
-alloc_history(History *observations, int count)
+alloc_history(History *observations, int historySize)
 {
-	observations->items = (HistoryItem *) palloc0(sizeof(HistoryItem) * count);
-	observations->index = 0;
-	observations->count = count;
-	observations->wraparound = false;
+	Size		capacity = history_capacity(historySize);
+
+	observations->base = 0;
+	observations->newSegment = NULL;
+	observations->newRing = NULL;
+	observations->copyPos = 0;
+
+	if (shard->shmemHistory != NULL)
+	{
+		/* Keep samples which survived collector restart */
+		observations->segment = NULL;
+		observations->ring = shard->shmemHistory;
+		return;
+	}
+
+	observations->segment = dsm_create(pgws_history_ring_size(capacity), 0);
+	/* Keep the mapping until we explicitly detach it */
+	dsm_pin_mapping(observations->segment);
+
+	observations->ring = (HistoryRing *) dsm_segment_address(observations->segment);
+	pgws_history_init(observations->ring, capacity);
 }
 
 /*
- * Reallocate memory for changed number of history items.
+ * Make waits history ring visible to readers.
  */
 static void
-realloc_history(History *observations, int count)
+publish_history(History *observations)
 {
-	HistoryItem	   *newitems;
-	int				copyCount,
-					i,
-					j;
+	if (observations->segment == NULL)
+		return;
+	pg_write_barrier();
+	shard->historyHandle = dsm_segment_handle(observations->segment);
+}
 
-	/* Allocate new array for history */
-	newitems = (HistoryItem *) palloc0(sizeof(HistoryItem) * count);
+/*
+ * Detach from waits history segment.  Readers which are still attached keep
+ * the segment alive until they finish.
+ */
+static void
+free_history(History *observations)
+{
+	if (observations->newSegment != NULL)
+		dsm_detach(observations->newSegment);
+	if (observations->segment != NULL)
+		dsm_detach(observations->segment);
+	observations->newSegment = NULL;
+	observations->newRing = NULL;
+	observations->segment = NULL;
+	observations->ring = NULL;
+}
 
-	/* Copy entries from old array to the new */
-	if (observations->wraparound)
-		copyCount = observations->count;
-	else
-		copyCount = observations->index;
+/*
+ * Start moving waits history to the ring of changed size.  Probes keep
+ * appending to the published ring, while the most recent samples are moved
+ * to the new one by chunks in continue_resize(), so a large history doesn't
+ * delay sampling.  A resize pending to another size is abandoned.
+ */
+static void
+start_resize(History *observations, int historySize)
+{
+	Size		capacity = history_capacity(historySize);
+
+	if (observations->newSegment != NULL)
+		dsm_detach(observations->newSegment);
+
+	observations->newSegment = dsm_create(pgws_history_ring_size(capacity), 0);
+	dsm_pin_mapping(observations->newSegment);
+	observations->newRing =
+		(HistoryRing *) dsm_segment_address(observations->newSegment);
+	pgws_history_init(observations->newRing, capacity);
+	observations->copyPos = 0;
+	observations->copyHead = pg_atomic_read_u64(&observations->ring->head);
+}
 
-	copyCount = Min(copyCount, count);
+/*
+ * Move next chunk of waits history to the resized ring, and switch to it
+ * once all the samples written so far are there.  Every chunk also takes
+ * what was written since the previous one, so the copy catches up with the
+ * head however fast probes write.  Counters of written and overwritten
+ * bytes go on from the old ring.
+ */
+static void
+continue_resize(History *observations)
+{
+	History		old = *observations;
+	uint64		head = pg_atomic_read_u64(&observations->ring->head);
+
+	observations->copyPos = pgws_history_copy_chunk(observations->newRing,
+													observations->ring,
+													observations->copyPos,
+													HISTORY_RESIZE_CHUNK +
+													(head - observations->copyHead));
+	observations->copyHead = head;
+	if (observations->copyPos != head)
+		return;
 
-	i = 0;
-	if (observations->wraparound)
-		j = observations->index + 1;
-	else
-		j = 0;
-	while (i < copyCount)
-	{
-		if (j >= observations->count)
-			j = 0;
-		memcpy(&newitems[i], &observations->items[j], sizeof(HistoryItem));
-		i++;
-		j++;
-	}
+	observations->base += head -
+		pg_atomic_read_u64(&observations->newRing->head);
+	observations->segment = observations->newSegment;
+	observations->ring = observations->newRing;
+	observations->newSegment = NULL;
+	observations->newRing = NULL;
+	publish_history(observations);
 
-	/* Switch to new history array */
-	pfree(observations->items);
-	observations->items = newitems;
-	observations->index = copyCount;
-	observations->count = count;
-	observations->wraparound = false;
+	old.newSegment = NULL;
+	free_history(&old);
 }
 
 static void
@@ -121,200 +282,1266 @@ handle_sigterm(SIGNAL_ARGS)
 }
 
 /*
- * Get next item of history with rotation.
+ * Hash of the packed profile key.
+ */
+static inline uint32
+profile_key_hash(const ProfileItem *key)
+{
+	uint64		h;
+
+	h = ((uint64) key->pid << 32) | key->wait_event_info;
+	h ^= ((uint64) key->queryRef << 32) | key->backendType;
+	/* Database and role are usually not profiled */
+	if (key->databaseId != InvalidOid || key->roleId != InvalidOid)
+		h = (h ^ (((uint64) key->databaseId << 32) | key->roleId)) *
+			UINT64CONST(0x9E3779B97F4A7C15);
+	h *= UINT64CONST(0x9E3779B97F4A7C15);
+	return (uint32) (h >> 32);
+}
+
+static inline bool
+profile_key_equal(const ProfileItem *a, const ProfileItem *b)
+{
+	return a->pid == b->pid &&
+		a->wait_event_info == b->wait_event_info &&
+		a->queryRef == b->queryRef &&
+		a->databaseId == b->databaseId &&
+		a->roleId == b->roleId &&
+		a->backendType == b->backendType;
+}
+
+/*
+ * Find slot of the profile table holding given key, or the empty slot where
+ * it should be inserted.
  */
-static HistoryItem *
-get_next_observation(History *observations)
+static ProfileSlot *
+profile_lookup(ProfileTable *table, const ProfileItem *key, bool *found)
 {
-	HistoryItem *result;
+	uint32		mask = table->nslots - 1,
+				i = profile_key_hash(key) & mask;
 
-	if (observations->index >= observations->count)
+	/* There are always empty slots, since nentries is capped below nslots */
+	for (;;)
 	{
-		observations->index = 0;
-		observations->wraparound = true;
+		ProfileSlot *slot = &table->slots[i];
+
+		if (!slot->used)
+		{
+			*found = false;
+			return slot;
+		}
+		if (profile_key_equal(&slot->item, key))
+		{
+			*found = true;
+			return slot;
+		}
+		i = (i + 1) & mask;
 	}
-	result = &observations->items[observations->index];
-	observations->index++;
-	return result;
 }
 
 /*
- * Read current waits from backends and write them to history array
- * and/or profile hash.
+ * Count sample of given weight in the profile table.
+ *
+ * Once the table holds pg_wait_sampling.profile_size entries, samples of new
+ * keys are accounted to a coarse entry of their wait event with zero pid and
+ * queryId.  Those may take a part of the spare slots, and when no room is
+ * left, the sample is only counted as overflow.
  */
 static void
-probe_waits(History *observations, HTAB *profile_hash,
-			bool write_history, bool write_profile, bool profile_pid)
+profile_add(ProfileTable *table, const ProfileItem *key, uint64 weight)
 {
-	int			i,
-				newSize;
-	TimestampTz	ts = GetCurrentTimestamp();
+	ProfileItem	coarse;
+	ProfileSlot *slot;
+	bool		found;
 
-	/* Realloc waits history if needed */
-	newSize = pgws_collector_hdr->historySize;
-	if (observations->count != newSize)
-		realloc_history(observations, newSize);
+	slot = profile_lookup(table, key, &found);
+	if (!found && table->nentries >= table->maxEntries)
+	{
+		MemSet(&coarse, 0, sizeof(coarse));
+		coarse.wait_event_info = key->wait_event_info;
+		key = &coarse;
 
-	/* Iterate PGPROCs under shared lock */
-	LWLockAcquire(ProcArrayLock, LW_SHARED);
-	for (i = 0; i < ProcGlobal->allProcCount; i++)
+		slot = profile_lookup(table, key, &found);
+		if (!found && table->nentries >= table->nslots / 4 * 3)
+		{
+			table->overflow++;
+			return;
+		}
+	}
+
+	slot->changecount++;
+	pg_write_barrier();
+	if (found)
+		slot->item.count += weight;
+	else
+	{
+		slot->item = *key;
+		slot->item.count = weight;
+		slot->used = true;
+		table->nentries++;
+	}
+	slot->item.generation = pg_atomic_read_u64(&table->generation) + 1;
+	pg_write_barrier();
+	slot->changecount++;
+}
+
+/*
+ * Remove all entries from the profile table.
+ */
+static void
+profile_reset(ProfileTable *table)
+{
+	uint32		i;
+
+	for (i = 0; i < table->nslots; i++)
 	{
-		HistoryItem		item,
-					   *observation;
-		PGPROC		   *proc = &ProcGlobal->allProcs[i];
+		ProfileSlot *slot = &table->slots[i];
 
-		if (proc->pid == 0)
+		if (!slot->used)
 			continue;
 
-		if (proc->wait_event_info == 0)
+		slot->changecount++;
+		pg_write_barrier();
+		slot->used = false;
+		pg_write_barrier();
+		slot->changecount++;
+	}
+	table->nentries = 0;
+	table->overflow = 0;
+	pg_atomic_write_u64(&table->resetGeneration,
+						pg_atomic_read_u64(&table->generation));
+}
+
+/*
+ * Switch profile series to the bucket of interval containing ts, reusing the
+ * oldest bucket.  Intervals without profile samples get no bucket.
+ */
+static void
+series_rotate(ProfileSeries *series, TimestampTz ts)
+{
+	TimestampTz	start = ts - ts % series->resolution;
+	SeriesBucket *bucket;
+
+	/* Shards may come with a bit older ts after another one rotated */
+	if (series->nbuckets == 0 ||
+		series->buckets[series->current].start_ts >= start)
+		return;
+
+	series->current = (series->current + 1) % series->nbuckets;
+	bucket = &series->buckets[series->current];
+
+	bucket->changecount++;
+	pg_write_barrier();
+	profile_reset(pgws_series_table(series, series->current));
+	bucket->start_ts = start;
+	pg_write_barrier();
+	bucket->changecount++;
+}
+
+/*
+ * Remove all buckets of profile series.
+ */
+static void
+series_reset(ProfileSeries *series)
+{
+	int			i;
+
+	for (i = 0; i < series->nbuckets; i++)
+	{
+		SeriesBucket *bucket = &series->buckets[i];
+
+		if (bucket->start_ts == 0)
 			continue;
 
-		/* Collect next wait event sample */
-		item.pid = proc->pid;
-		item.wait_event_info = proc->wait_event_info;
+		bucket->changecount++;
+		pg_write_barrier();
+		profile_reset(pgws_series_table(series, i));
+		bucket->start_ts = 0;
+		pg_write_barrier();
+		bucket->changecount++;
+	}
+}
 
-		if (pgws_collector_hdr->profileQueries)
-			item.queryId = pgws_proc_queryids[i];
-		else
-			item.queryId = 0;
+/*
+ * Find slot of the heavy hitters index holding given key, or the empty slot
+ * where it should be inserted.
+ */
+static uint32
+topn_lookup(TopNTable *table, const ProfileItem *key, bool *found)
+{
+	int32	   *index = pgws_topn_index(table);
+	uint32		mask = table->nslots - 1,
+				i = profile_key_hash(key) & mask;
 
-		item.ts = ts;
+	for (;;)
+	{
+		ProfileItem *item;
 
-		/* Write to the history if needed */
-		if (write_history)
+		if (index[i] < 0)
 		{
-			observation = get_next_observation(observations);
-			*observation = item;
+			*found = false;
+			return i;
 		}
-
-		/* Write to the profile if needed */
-		if (write_profile)
+		item = &table->entries[index[i]].item;
+		if (profile_key_equal(item, key))
 		{
-			ProfileItem	   *profileItem;
-			bool			found;
+			*found = true;
+			return i;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Remove given slot from the heavy hitters index, moving back the entries
+ * of the same probe sequence.
+ */
+static void
+topn_index_delete(TopNTable *table, uint32 slot)
+{
+	int32	   *index = pgws_topn_index(table);
+	uint32		mask = table->nslots - 1,
+				i = slot,
+				j = slot;
 
-			if (!profile_pid)
-				item.pid = 0;
+	for (;;)
+	{
+		uint32		k;
 
-			profileItem = (ProfileItem *) hash_search(profile_hash, &item, HASH_ENTER, &found);
-			if (found)
-				profileItem->count++;
-			else
-				profileItem->count = 1;
-		}
+		j = (j + 1) & mask;
+		if (index[j] < 0)
+			break;
+
+		/* Entry may move to the hole unless its home slot is in (i, j] */
+		k = profile_key_hash(&table->entries[index[j]].item) & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		index[i] = index[j];
+		i = j;
 	}
-	LWLockRelease(ProcArrayLock);
+	index[i] = -1;
+}
+
+static inline void
+topn_heap_set(TopNTable *table, int pos, int32 e)
+{
+	pgws_topn_heap(table)[pos] = e;
+	table->entries[e].heapIndex = pos;
 }
 
 /*
- * Send waits history to shared memory queue.
+ * Restore order of the min-heap after count of entry at pos was increased.
  */
 static void
-send_history(History *observations, shm_mq_handle *mqh)
+topn_sift_down(TopNTable *table, int pos)
 {
-	Size	count,
-			i;
-	shm_mq_result	mq_result;
+	int32	   *heap = pgws_topn_heap(table);
+	int			n = (int) table->nentries;
+	int32		e = heap[pos];
+	uint64		count = table->entries[e].item.count;
 
-	if (observations->wraparound)
-		count = observations->count;
-	else
-		count = observations->index;
+	for (;;)
+	{
+		int			child = 2 * pos + 1;
+
+		if (child >= n)
+			break;
+		if (child + 1 < n &&
+			table->entries[heap[child + 1]].item.count <
+			table->entries[heap[child]].item.count)
+			child++;
+		if (count <= table->entries[heap[child]].item.count)
+			break;
+		topn_heap_set(table, pos, heap[child]);
+		pos = child;
+	}
+	topn_heap_set(table, pos, e);
+}
+
+/*
+ * Restore order of the min-heap after entry was appended at pos.
+ */
+static void
+topn_sift_up(TopNTable *table, int pos)
+{
+	int32	   *heap = pgws_topn_heap(table);
+	int32		e = heap[pos];
+	uint64		count = table->entries[e].item.count;
 
-	mq_result = shm_mq_send_compat(mqh, sizeof(count), &count, false, true);
-	if (mq_result == SHM_MQ_DETACHED)
+	while (pos > 0)
 	{
-		ereport(WARNING,
-				(errmsg("pg_wait_sampling collector: "
-						"receiver of message queue has been detached")));
+		int			parent = (pos - 1) / 2;
+
+		if (table->entries[heap[parent]].item.count <= count)
+			break;
+		topn_heap_set(table, pos, heap[parent]);
+		pos = parent;
+	}
+	topn_heap_set(table, pos, e);
+}
+
+/*
+ * Count sample of given weight in heavy hitters profile.
+ */
+static void
+topn_add(TopNTable *table, const ProfileItem *key, uint64 weight)
+{
+	TopNEntry  *entry;
+	uint32		slot;
+	int32		e;
+	bool		found;
+
+	if (table->maxEntries == 0)
+		return;
+
+	slot = topn_lookup(table, key, &found);
+	if (found)
+	{
+		entry = &table->entries[pgws_topn_index(table)[slot]];
+		entry->changecount++;
+		pg_write_barrier();
+		entry->item.count += weight;
+		entry->item.generation = pg_atomic_read_u64(&pgws_profile_table->generation) + 1;
+		pg_write_barrier();
+		entry->changecount++;
+		topn_sift_down(table, entry->heapIndex);
+		return;
+	}
+
+	if (table->nentries < table->maxEntries)
+	{
+		/*
+		 * Take a free entry.  Readers which saw nentries before reset may
+		 * still read it, so it's changed under changecount too.
+		 */
+		e = (int32) table->nentries;
+		entry = &table->entries[e];
+		entry->changecount++;
+		pg_write_barrier();
+		entry->item = *key;
+		entry->item.count = weight;
+		entry->item.generation = pg_atomic_read_u64(&pgws_profile_table->generation) + 1;
+		entry->error = 0;
+		pg_write_barrier();
+		entry->changecount++;
+		pgws_topn_index(table)[slot] = e;
+		pg_write_barrier();
+		table->nentries++;
+		topn_heap_set(table, e, e);
+		topn_sift_up(table, e);
 		return;
 	}
-	for (i = 0; i < count; i++)
+
+	/* Replace the entry with minimal count */
+	e = pgws_topn_heap(table)[0];
+	entry = &table->entries[e];
+	topn_index_delete(table, topn_lookup(table, &entry->item, &found));
+
+	entry->changecount++;
+	pg_write_barrier();
+	entry->error = entry->item.count;
+	entry->item = *key;
+	entry->item.count = entry->error + weight;
+	entry->item.generation = pg_atomic_read_u64(&pgws_profile_table->generation) + 1;
+	pg_write_barrier();
+	entry->changecount++;
+
+	pgws_topn_index(table)[topn_lookup(table, key, &found)] = e;
+	topn_sift_down(table, 0);
+}
+
+/*
+ * Remove all entries from heavy hitters profile.
+ */
+static void
+topn_reset(TopNTable *table)
+{
+	table->changecount++;
+	pg_write_barrier();
+	table->nentries = 0;
+	memset(pgws_topn_index(table), 0xFF, sizeof(int32) * table->nslots);
+	pg_write_barrier();
+	table->changecount++;
+}
+
+/*
+ * Find slot of the histogram table holding given key, or the empty slot
+ * where it should be inserted.
+ */
+static WaitHistogramSlot *
+histogram_lookup(WaitHistogramTable *table, uint32 wait_event_info,
+				 uint64 queryId, bool *found)
+{
+	uint32		mask = table->nslots - 1,
+				i;
+	uint64		h;
+
+	h = ((uint64) wait_event_info ^ queryId) * UINT64CONST(0x9E3779B97F4A7C15);
+	i = (uint32) (h >> 32) & mask;
+
+	for (;;)
+	{
+		WaitHistogramSlot *slot = &table->slots[i];
+
+		if (!slot->used)
+		{
+			*found = false;
+			return slot;
+		}
+		if (slot->item.wait_event_info == wait_event_info &&
+			slot->item.queryId == queryId)
+		{
+			*found = true;
+			return slot;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Account finished wait of given duration in microseconds.  Overflow is
+ * handled like in profile_add(), with coarse entries having zero queryId.
+ */
+static void
+histogram_add(WaitHistogramTable *table, uint32 wait_event_info,
+			  uint64 queryId, int64 duration)
+{
+	WaitHistogramSlot *slot;
+	bool		found;
+	int			bucket = 0;
+
+	slot = histogram_lookup(table, wait_event_info, queryId, &found);
+	if (!found && table->nentries >= table->maxEntries)
 	{
-		mq_result = shm_mq_send_compat(mqh,
-								sizeof(HistoryItem),
-								&observations->items[i],
-								false,
-								true);
-		if (mq_result == SHM_MQ_DETACHED)
+		queryId = 0;
+		slot = histogram_lookup(table, wait_event_info, queryId, &found);
+		if (!found && table->nentries >= table->nslots / 4 * 3)
 		{
-			ereport(WARNING,
-					(errmsg("pg_wait_sampling collector: "
-							"receiver of message queue has been detached")));
+			table->overflow++;
 			return;
 		}
 	}
+
+	while (bucket < WAIT_HISTOGRAM_BUCKETS - 1 && duration >= ((int64) 2 << bucket))
+		bucket++;
+
+	slot->changecount++;
+	pg_write_barrier();
+	if (!found)
+	{
+		slot->item.wait_event_info = wait_event_info;
+		slot->item.queryId = queryId;
+		MemSet(slot->item.buckets, 0, sizeof(slot->item.buckets));
+		slot->used = true;
+		table->nentries++;
+	}
+	slot->item.buckets[bucket]++;
+	pg_write_barrier();
+	slot->changecount++;
 }
 
 /*
- * Send profile to shared memory queue.
+ * Remove all entries from the histogram table.
  */
 static void
-send_profile(HTAB *profile_hash, shm_mq_handle *mqh)
+histogram_reset(WaitHistogramTable *table)
 {
-	HASH_SEQ_STATUS	scan_status;
-	ProfileItem	   *item;
-	Size			count = hash_get_num_entries(profile_hash);
-	shm_mq_result	mq_result;
+	uint32		i;
 
-	mq_result = shm_mq_send_compat(mqh, sizeof(count), &count, false, true);
-	if (mq_result == SHM_MQ_DETACHED)
+	for (i = 0; i < table->nslots; i++)
 	{
-		ereport(WARNING,
-				(errmsg("pg_wait_sampling collector: "
-						"receiver of message queue has been detached")));
+		WaitHistogramSlot *slot = &table->slots[i];
+
+		if (!slot->used)
+			continue;
+
+		slot->changecount++;
+		pg_write_barrier();
+		slot->used = false;
+		pg_write_barrier();
+		slot->changecount++;
+	}
+	table->nentries = 0;
+	table->overflow = 0;
+}
+
+/*
+ * Track wait of given PGPROC between probes.  item is NULL if the process
+ * isn't waiting now.  Once the process leaves the wait it was seen in, the
+ * wait is accounted in histograms with duration from the probe it was first
+ * seen on to the current one, so the precision is the sampling period.
+ */
+static void
+track_wait(ProcWait *waits, int procno, const HistoryItem *item,
+		   TimestampTz ts)
+{
+	ProcWait   *w = &waits[procno];
+
+	if (item != NULL &&
+		w->pid == item->pid &&
+		w->wait_event_info == item->wait_event_info &&
+		w->queryId == item->queryId)
 		return;
+
+	if (w->wait_event_info != 0)
+		histogram_add(pgws_histogram_table, w->wait_event_info, w->queryId,
+					  ts - w->start_ts);
+
+	if (item != NULL)
+	{
+		w->pid = item->pid;
+		w->wait_event_info = item->wait_event_info;
+		w->queryId = item->queryId;
+		w->start_ts = ts;
 	}
-	hash_seq_init(&scan_status, profile_hash);
-	while ((item = (ProfileItem *) hash_seq_search(&scan_status)) != NULL)
+	else
+		w->wait_event_info = 0;
+	w->lockResolved = false;
+}
+
+/*
+ * Attach lock and blocker already resolved for the current wait of given
+ * PGPROC to the sample.  Returns true if the sample is a lock wait, whose
+ * blocker is not known yet.
+ */
+static bool
+add_lock_info(ProcWait *waits, int procno, HistoryItem *item)
+{
+	ProcWait   *w = &waits[procno];
+
+	item->hasLockInfo = false;
+	if (!IS_LOCK_WAIT(item->wait_event_info))
+		return false;
+
+	if (!w->lockResolved)
+		return true;
+
+	item->hasLockInfo = true;
+	item->blockerPid = w->blockerPid;
+	item->locktag = w->locktag;
+	return false;
+}
+
+/*
+ * Pid of the first process which holds given lock in a mode conflicting
+ * with the one requested by the waiter, or 0 if there is none in the lock
+ * status snapshot.  Members of the waiter's lock group don't block it.
+ */
+static uint32
+find_lock_blocker(LockData *locks, LockInstanceData *waiter)
+{
+	const LOCKMASK *conflicts = GetLockTagsMethodTable(&waiter->locktag)->conflictTab;
+	int			i;
+
+	for (i = 0; i < locks->nelements; i++)
 	{
-		mq_result = shm_mq_send_compat(mqh, sizeof(ProfileItem), item, false,
-									   true);
-		if (mq_result == SHM_MQ_DETACHED)
+		LockInstanceData *holder = &locks->locks[i];
+
+		if (holder->pid == waiter->pid ||
+			(waiter->leaderPid != 0 && holder->leaderPid == waiter->leaderPid))
+			continue;
+		if ((holder->holdMask & conflicts[waiter->waitLockMode]) == 0)
+			continue;
+		if (memcmp(&holder->locktag, &waiter->locktag, sizeof(LOCKTAG)) != 0)
+			continue;
+		return (uint32) holder->pid;
+	}
+	return 0;
+}
+
+/*
+ * Look up locks and blockers of heavyweight lock waits which aren't resolved
+ * yet.  The lock status snapshot takes all the lock manager partition locks,
+ * so it's taken once for all the waits of the shard, at most once per
+ * pg_wait_sampling.lock_blockers_period, and each wait is resolved only
+ * once.  Samples taken before that have no lock details.  Only holders of
+ * conflicting modes are reported as blockers, not waiters queued ahead.
+ */
+static void
+resolve_lock_blockers(ProcWait *waits, TimestampTz ts)
+{
+	MemoryContext	oldcontext;
+	LockData	   *locks;
+	int				i;
+
+	if (!TimestampDifferenceExceeds(blockers_ts, ts,
+									pgws_collector_hdr->lockBlockersPeriod))
+		return;
+	blockers_ts = ts;
+
+	if (blockers_context == NULL)
+		blockers_context = AllocSetContextCreate(TopMemoryContext,
+												 "pg_wait_sampling lock blockers",
+												 ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(blockers_context);
+
+	locks = GetLockStatusData();
+
+	for (i = shard_no; i < ProcGlobal->allProcCount; i += shard_count)
+	{
+		ProcWait   *w = &waits[i];
+		volatile PGPROC *proc = &ProcGlobal->allProcs[i];
+		LockInstanceData *waiter = NULL;
+		LOCK	   *lock;
+		int			j;
+
+		if (!IS_LOCK_WAIT(w->wait_event_info) || w->lockResolved)
+			continue;
+
+		for (j = 0; j < locks->nelements; j++)
 		{
-			hash_seq_term(&scan_status);
-			ereport(WARNING,
-					(errmsg("pg_wait_sampling collector: "
-							"receiver of message queue has been detached")));
-			return;
+			if (locks->locks[j].pid == w->pid &&
+				locks->locks[j].waitLockMode != NoLock)
+			{
+				waiter = &locks->locks[j];
+				break;
+			}
 		}
+		if (waiter == NULL)
+			continue;
+
+		/*
+		 * The lock is read without the partition lock.  The process must be
+		 * still waiting on the lock of the snapshot, otherwise try next time.
+		 */
+		lock = proc->waitLock;
+		if (lock == NULL ||
+			memcmp(&lock->tag, &waiter->locktag, sizeof(LOCKTAG)) != 0)
+			continue;
+		pg_read_barrier();
+		if (proc->pid != w->pid || proc->waitLock != lock)
+			continue;
+
+		w->locktag = waiter->locktag;
+		w->blockerPid = find_lock_blocker(locks, waiter);
+		w->lockResolved = true;
 	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(blockers_context);
 }
 
 /*
- * Make hash table for wait profile.
+ * Read wait event of given PGPROC.  Returns false if the process doesn't
+ * wait for anything, or its wait isn't sampled.
+ *
+ * Without ProcArrayLock the process may exit, or its PGPROC may be reused by
+ * another one, while we read it.  So the pid is checked again after reading
+ * the rest, and the sample is dropped if it changed.
  */
-static HTAB *
-make_profile_hash()
+static bool
+read_proc_wait(int procno, HistoryItem *item)
 {
-	HASHCTL hash_ctl;
+	volatile PGPROC *proc = &ProcGlobal->allProcs[procno];
+	int			pid = proc->pid;
+
+	if (pid == 0)
+		return false;
 
-	hash_ctl.hash = tag_hash;
-	hash_ctl.hcxt = TopMemoryContext;
+	item->wait_event_info = proc->wait_event_info;
+	if (item->wait_event_info == 0)
+		return false;
+
+	/* Skip waits and processes excluded by sampling filters */
+	if (pgws_wait_listed(&pgws_collector_hdr->waitFilter,
+						 item->wait_event_info))
+		return false;
+	if (pgws_collector_hdr->excludedBackendTypes != 0 &&
+		(pgws_collector_hdr->excludedBackendTypes &
+		 (1 << proc_backend_type(procno))) != 0)
+		return false;
 
 	if (pgws_collector_hdr->profileQueries)
-		hash_ctl.keysize = offsetof(ProfileItem, count);
+		item->queryId = pgws_proc_queryids[procno];
+	else
+		item->queryId = 0;
+
+	pg_read_barrier();
+	if (proc->pid != pid)
+		return false;
+
+	item->pid = pid;
+	return true;
+}
+
+/*
+ * Rebuild dense list of PGPROCs of the shard which belong to live processes.
+ */
+static void
+refresh_active_procs(ActiveProcs *active, ProcWait *waits, TimestampTz ts)
+{
+	int			i;
+
+	active->count = 0;
+	for (i = shard_no; i < ProcGlobal->allProcCount; i += shard_count)
+	{
+		if (((volatile PGPROC *) &ProcGlobal->allProcs[i])->pid != 0)
+			active->procnos[active->count++] = i;
+		else
+			track_wait(waits, i, NULL, ts);	/* finish waits of exited ones */
+	}
+	active->refresh_ts = ts;
+}
+
+/*
+ * Rebuild map of pids to PGPROC numbers.  Readers which miss a pid while the
+ * map is cleared fall back to the scan of PGPROCs.
+ */
+static void
+refresh_pid_map(ProcPidMap *map)
+{
+	uint32		mask = map->nslots - 1,
+				slot;
+	int			i;
+
+	for (slot = 0; slot < map->nslots; slot++)
+		pg_atomic_write_u64(&map->slots[slot], 0);
+
+	for (i = 0; i < ProcGlobal->allProcCount; i++)
+	{
+		int			pid = ((volatile PGPROC *) &ProcGlobal->allProcs[i])->pid;
+
+		if (pid == 0)
+			continue;
+
+		slot = pgws_pid_hash(pid) & mask;
+		while (pg_atomic_read_u64(&map->slots[slot]) != 0)
+			slot = (slot + 1) & mask;
+		pg_atomic_write_u64(&map->slots[slot], ((uint64) pid << 32) | (uint32) i);
+	}
+}
+
+/*
+ * Coarse type of process owning given PGPROC.
+ */
+static uint8
+proc_backend_type(int procno)
+{
+	volatile PGPROC *proc = &ProcGlobal->allProcs[procno];
+
+	if (procno >= MaxBackends)
+		return PGWS_BACKEND_AUXILIARY;
+#if PG_VERSION_NUM >= 140000
+	if (proc->statusFlags & PROC_IS_AUTOVACUUM)
+		return PGWS_BACKEND_AUTOVACUUM;
+#else
+	if (ProcGlobal->allPgXact[procno].vacuumFlags & PROC_IS_AUTOVACUUM)
+		return PGWS_BACKEND_AUTOVACUUM;
+#endif
+#if PG_VERSION_NUM >= 100000
+	if (proc->isBackgroundWorker)
+		return PGWS_BACKEND_BGWORKER;
+#endif
+	return PGWS_BACKEND_REGULAR;
+}
+
+/*
+ * Build profile key of the sample of given PGPROC.  queryId is interned
+ * later, under the aggregate lock.
+ */
+static void
+make_profile_key(int procno, const HistoryItem *item, bool profile_pid,
+				 ProfileItem *key)
+{
+	volatile PGPROC *proc = &ProcGlobal->allProcs[procno];
+
+	MemSet(key, 0, sizeof(*key));
+	key->pid = profile_pid ? item->pid : 0;
+	key->wait_event_info = item->wait_event_info;
+	if (pgws_collector_hdr->profileDatabase)
+		key->databaseId = proc->databaseId;
+	if (pgws_collector_hdr->profileRole)
+		key->roleId = proc->roleId;
+	if (pgws_collector_hdr->profileBackendType)
+		key->backendType = proc_backend_type(procno);
+}
+
+/*
+ * Copy wait of given PGPROC to the probe.
+ */
+static void
+read_sample(int procno, ProcSample *sample, TimestampTz ts,
+			bool write_profile, bool profile_pid)
+{
+	sample->procno = procno;
+	sample->item.ts = ts;
+	sample->waiting = read_proc_wait(procno, &sample->item);
+	if (sample->waiting && write_profile)
+		make_profile_key(procno, &sample->item, profile_pid, &sample->key);
+}
+
+/*
+ * Shared profile, histograms and heavy hitters have the single writer at a
+ * time, so collector shards and backends resetting them take turns.
+ */
+static inline void
+aggregate_lock(void)
+{
+	LWLockAcquire(pgws_collector_hdr->aggregateLock, LW_EXCLUSIVE);
+}
+
+static inline void
+aggregate_unlock(void)
+{
+	LWLockRelease(pgws_collector_hdr->aggregateLock);
+}
+
+/*
+ * Remove all queryIds from the dictionary.  Only done on profile reset, when
+ * no entries refer to them anymore.
+ */
+static void
+query_dict_reset(QueryIdDict *dict)
+{
+	pg_atomic_write_u32(&dict->generation,
+						pg_atomic_read_u32(&dict->generation) + 1);
+	pg_write_barrier();
+	pg_atomic_write_u32(&dict->nentries, 0);
+	pg_write_barrier();
+	memset(pgws_query_dict_index(dict), 0, sizeof(uint32) * dict->nslots);
+	dict->overflow = 0;
+}
+
+/*
+ * Reset profile, histograms, heavy hitters and series from the calling
+ * backend.  Collector shards wait on aggregateLock meanwhile, and readers
+ * retry slots caught while their changecounts are odd, as they do with
+ * collector updates.
+ */
+void
+pgws_reset_profile(void)
+{
+	aggregate_lock();
+	profile_reset(pgws_profile_table);
+	histogram_reset(pgws_histogram_table);
+	topn_reset(pgws_topn_table);
+	series_reset(pgws_profile_series);
+	query_dict_reset(pgws_query_dict);
+	aggregate_unlock();
+}
+
+/*
+ * Drop captured waits and arm capture trigger again.
+ */
+void
+pgws_reset_capture(void)
+{
+	int			i;
+
+	aggregate_lock();
+	for (i = 0; i < pgws_collector_hdr->nshards; i++)
+	{
+		HistoryRing *ring = pgws_collector_hdr->shards[i].captureRing;
+
+		/* Readers see the samples are gone as the tail passed them */
+		if (ring != NULL)
+			pg_atomic_write_u64(&ring->tail, pg_atomic_read_u64(&ring->head));
+	}
+	pgws_collector_hdr->captureStart = 0;
+	pgws_collector_hdr->captureEnd = 0;
+	pgws_collector_hdr->captureEvent = 0;
+	pgws_collector_hdr->captureWaiting = 0;
+	pgws_collector_hdr->captureState = CAPTURE_ARMED;
+	aggregate_unlock();
+}
+
+/*
+ * Start high-resolution capture fired by nwaiting processes seen in the
+ * trigger waits, unless another shard has just done it.  Returns true if
+ * capture is running.
+ */
+static bool
+start_capture(uint32 wait_event_info, int nwaiting, TimestampTz ts)
+{
+	bool		result;
+
+	aggregate_lock();
+	if (pgws_collector_hdr->captureState == CAPTURE_ARMED)
+	{
+		pgws_collector_hdr->captureStart = ts;
+		pgws_collector_hdr->captureEnd = ts +
+			(TimestampTz) pgws_collector_hdr->captureDuration * 1000;
+		pgws_collector_hdr->captureEvent = wait_event_info;
+		pgws_collector_hdr->captureWaiting = nwaiting;
+		pgws_collector_hdr->captureState = CAPTURE_ACTIVE;
+	}
+	result = (pgws_collector_hdr->captureState == CAPTURE_ACTIVE);
+	aggregate_unlock();
+
+	return result;
+}
+
+/*
+ * Put samples of the probe to the shard's capture ring.  Capture is frozen
+ * once its window is over, or the ring is full, so the start of the window
+ * is never overwritten.
+ */
+static void
+append_capture(HistoryBatch *batch, TimestampTz ts)
+{
+	aggregate_lock();
+	if (pgws_collector_hdr->captureState == CAPTURE_ACTIVE)
+	{
+		if (ts >= pgws_collector_hdr->captureEnd ||
+			!pgws_history_append_no_evict(shard->captureRing, batch))
+		{
+			pgws_collector_hdr->captureEnd =
+				Min(pgws_collector_hdr->captureEnd, ts);
+			pgws_collector_hdr->captureState = CAPTURE_FROZEN;
+		}
+	}
+	aggregate_unlock();
+}
+
+/*
+ * Id of queryId in the dictionary, which is added there if it's new.
+ * Returns 0 if the dictionary is full.
+ */
+static uint32
+query_dict_intern(QueryIdDict *dict, uint64 queryId)
+{
+	uint32	   *index = pgws_query_dict_index(dict);
+	uint32		mask = dict->nslots - 1,
+				nentries,
+				i;
+
+	if (queryId == 0)
+		return 0;
+
+	/* There are always empty slots, since nslots is twice maxEntries */
+	i = (uint32) ((queryId * UINT64CONST(0x9E3779B97F4A7C15)) >> 32) & mask;
+	while (index[i] != 0)
+	{
+		if (dict->queryIds[index[i] - 1] == queryId)
+			return index[i];
+		i = (i + 1) & mask;
+	}
+
+	nentries = pg_atomic_read_u32(&dict->nentries);
+	if (nentries >= dict->maxEntries)
+	{
+		dict->overflow++;
+		return 0;
+	}
+	dict->queryIds[nentries] = queryId;
+	index[i] = nentries + 1;
+	pg_write_barrier();
+	pg_atomic_write_u32(&dict->nentries, nentries + 1);
+	return nentries + 1;
+}
+
+/*
+ * Account samples of the probe in wait histograms and the profile.
+ */
+static void
+write_profile_samples(ProcSample *samples, int nsamples, ProcWait *waits,
+					  bool write_profile, uint64 weight, TimestampTz ts)
+{
+	int			i;
+
+	aggregate_lock();
+
+	if (write_profile)
+		series_rotate(pgws_profile_series, ts);
+
+	for (i = 0; i < nsamples; i++)
+	{
+		ProcSample *sample = &samples[i];
+
+		track_wait(waits, sample->procno,
+				   sample->waiting ? &sample->item : NULL, ts);
+		if (!sample->waiting || !write_profile)
+			continue;
+
+		sample->key.queryRef = query_dict_intern(pgws_query_dict,
+												 sample->item.queryId);
+		profile_add(pgws_profile_table, &sample->key, weight);
+		topn_add(pgws_topn_table, &sample->key, weight);
+		if (pgws_profile_series->nbuckets > 0)
+			profile_add(pgws_series_table(pgws_profile_series,
+										  pgws_profile_series->current),
+						&sample->key, weight);
+	}
+
+	/* Publish completed profile generation */
+	if (write_profile)
+	{
+		pg_write_barrier();
+		pg_atomic_write_u64(&pgws_profile_table->generation,
+							pg_atomic_read_u64(&pgws_profile_table->generation) + 1);
+	}
+
+	aggregate_unlock();
+}
+
+/*
+ * Read current waits from backends of the shard and write them to history,
+ * profile and/or capture ring, and fire capture if its trigger waits are
+ * seen.  Returns the number of processes waiting in the wait class watched
+ * by adaptive sampling, and sets *lock_us to the time ProcArrayLock was
+ * held.
+ */
+static int
+probe_waits(History *observations, ActiveProcs *active, ProcWait *waits,
+			ProcSample *samples, bool write_history, bool write_profile,
+			bool write_capture, bool profile_pid, uint64 weight,
+			int64 *lock_us)
+{
+	int			i,
+				newSize,
+				nsamples = 0,
+				nwaiting = 0,
+				ntriggering = 0;
+	bool		unresolvedLocks = false,
+				captureArmed;
+	uint32		waitClass = (uint32) pgws_collector_hdr->adaptiveWaitClass,
+				triggerEvent = 0;
+	Size		batchCapacity = 0;
+	TimestampTz	ts = GetCurrentTimestamp();
+
+	/*
+	 * Resize waits history if needed.  The preallocated ring has fixed
+	 * size.
+	 */
+	newSize = pgws_collector_hdr->historySize;
+	if (observations->segment != NULL)
+	{
+		Size		capacity = history_capacity(newSize);
+
+		if (observations->newRing == NULL)
+		{
+			if (observations->ring->capacity != capacity)
+				start_resize(observations, newSize);
+		}
+		else if (observations->ring->capacity == capacity)
+		{
+			/* Size was changed back before the resize completed */
+			dsm_detach(observations->newSegment);
+			observations->newSegment = NULL;
+			observations->newRing = NULL;
+		}
+		else if (observations->newRing->capacity != capacity)
+			start_resize(observations, newSize);
+
+		if (observations->newRing != NULL)
+			continue_resize(observations);
+	}
+
+	*lock_us = 0;
+
+	if (pgws_collector_hdr->locklessSampling)
+	{
+		/*
+		 * Look only through PGPROCs of live processes without taking
+		 * ProcArrayLock.  Processes started since the last refresh are
+		 * missed until the next one.
+		 */
+		if (TimestampDifferenceExceeds(active->refresh_ts, ts,
+									   ACTIVE_PROCS_REFRESH_MS))
+		{
+			aggregate_lock();
+			refresh_active_procs(active, waits, ts);
+			aggregate_unlock();
+		}
+
+		for (i = 0; i < active->count; i++)
+			read_sample(active->procnos[i], &samples[nsamples++], ts,
+						write_profile, profile_pid);
+	}
+	else
+	{
+		int64		lock_start;
+
+		/* Copy PGPROCs under shared lock */
+		LWLockAcquire(ProcArrayLock, LW_SHARED);
+		lock_start = monotonic_us();
+		for (i = shard_no; i < ProcGlobal->allProcCount; i += shard_count)
+			read_sample(i, &samples[nsamples++], ts,
+						write_profile, profile_pid);
+		*lock_us = monotonic_us() - lock_start;
+		LWLockRelease(ProcArrayLock);
+	}
+
+	write_profile_samples(samples, nsamples, waits, write_profile, weight, ts);
+
+	/*
+	 * History and capture rings are the shard's own ones.  While capture is
+	 * armed the batch is encoded in case the trigger fires.  The batch is
+	 * sized for the larger ring and cropped when put to the smaller one, so
+	 * a small capture ring doesn't truncate history.
+	 */
+	captureArmed = (shard->captureRing != NULL &&
+					pgws_collector_hdr->captureEnabled &&
+					pgws_collector_hdr->captureState == CAPTURE_ARMED);
+	if (write_capture || captureArmed)
+		batchCapacity = shard->captureRing->capacity;
+	if (write_history)
+		batchCapacity = Max(batchCapacity, observations->ring->capacity);
+	if (batchCapacity > 0)
+		pgws_history_batch_begin(observations->batch, ts, batchCapacity);
+	for (i = 0; i < nsamples; i++)
+	{
+		ProcSample *sample = &samples[i];
+
+		if (!sample->waiting)
+			continue;
+
+		if (add_lock_info(waits, sample->procno, &sample->item))
+			unresolvedLocks = true;
+		if (batchCapacity > 0)
+			pgws_history_batch_add(observations->batch, &sample->item);
+		if (waitClass == 0 ||
+			(sample->item.wait_event_info & 0xFF000000) == waitClass)
+			nwaiting++;
+		if (captureArmed &&
+			pgws_wait_listed(&pgws_collector_hdr->captureWaits,
+							 sample->item.wait_event_info) &&
+			ntriggering++ == 0)
+			triggerEvent = sample->item.wait_event_info;
+	}
+	if (write_history)
+		pgws_history_append(observations->ring, observations->batch);
+	if (captureArmed && ntriggering >= pgws_collector_hdr->captureThreshold)
+		write_capture = start_capture(triggerEvent, ntriggering, ts);
+	if (write_capture)
+		append_capture(observations->batch, ts);
+
+	if (shard_no == 0 &&
+		TimestampDifferenceExceeds(pid_map_ts, ts, PID_MAP_REFRESH_MS))
+	{
+		refresh_pid_map(pgws_proc_pids);
+		pid_map_ts = ts;
+	}
+
+	/*
+	 * Resolve blockers for the next samples.  That takes all the lock manager
+	 * partition locks to copy the lock table, hence the period between tries.
+	 */
+	if (unresolvedLocks && pgws_collector_hdr->lockBlockers)
+		resolve_lock_blockers(waits, ts);
+
+	return nwaiting;
+}
+
+/*
+ * Level of adaptive sampling for given number of waiting processes.  The
+ * rate is halved when nothing waits, and doubled every time the number of
+ * waiting processes reaches the next multiple of threshold by power of 2.
+ */
+static int
+adaptive_level(int nwaiting, int threshold)
+{
+	int			level = 0;
+
+	if (nwaiting == 0)
+		return ADAPTIVE_IDLE_LEVEL;
+
+	while (level < ADAPTIVE_MAX_LEVEL && nwaiting >= threshold << level)
+		level++;
+
+	return level;
+}
+
+/*
+ * Sampling period in microseconds for period GUC in milliseconds and given
+ * adaptive sampling level.
+ */
+static int64
+sampling_period(double period_ms, int level)
+{
+	int64		period = (int64) (period_ms * 1000.0);
+
+	if (level < 0)
+		period <<= -level;
 	else
-		hash_ctl.keysize = offsetof(ProfileItem, queryId);
+		period >>= level;
+
+	return Max(period, MIN_SAMPLING_PERIOD_US);
+}
 
-	hash_ctl.entrysize = sizeof(ProfileItem);
-	return hash_create("Waits profile hash", 1024, &hash_ctl,
-					   HASH_FUNCTION | HASH_ELEM);
+/*
+ * Weight of profile sample in 1/PROFILE_COUNT_SCALE of samples of the
+ * configured period, for elapsed_us passed since the previous profile sample.
+ * Elapsed time is taken in the bounds the schedule keeps periods in, so that
+ * stalls of the collector aren't counted to waits seen after them.  Fraction
+ * of the weight is carried to the next sample in *carry.
+ */
+static uint64
+profile_weight(int64 elapsed_us, double period_ms, int64 *carry)
+{
+	int64		period = (int64) (period_ms * 1000.0);
+	int64		units;
+
+	elapsed_us = Max(elapsed_us, MIN_SAMPLING_PERIOD_US);
+	elapsed_us = Min(elapsed_us, sampling_period(period_ms, ADAPTIVE_IDLE_LEVEL));
+	units = elapsed_us * PROFILE_COUNT_SCALE + *carry;
+	*carry = units % period;
+
+	return (uint64) (units / period);
 }
 
 /*
- * Delta between two timestamps in milliseconds.
+ * Current time of monotonic clock in microseconds.
  */
 static int64
-millisecs_diff(TimestampTz tz1, TimestampTz tz2)
+monotonic_us(void)
 {
-	long	secs;
-	int		microsecs;
+	instr_time	now;
 
-	TimestampDifference(tz1, tz2, &secs, &microsecs);
+	INSTR_TIME_SET_CURRENT(now);
+	return (int64) INSTR_TIME_GET_MICROSEC(now);
+}
 
-	return secs * 1000 + microsecs / 1000;
+/*
+ * Move sample schedule to the next tick due at next_us.  Ticks are kept on
+ * the grid of period, so lag doesn't accumulate.  If the collector fell
+ * behind by a whole period, missed ticks are dropped and schedule restarts
+ * from now.  Number of dropped ticks is added to *missed.
+ */
+static int64
+schedule_next(int64 next_us, int64 now_us, int64 period, uint64 *missed)
+{
+	if (now_us - next_us >= period)
+	{
+		*missed += (uint64) ((now_us - next_us) / period);
+		return now_us;
+	}
+	return next_us;
+}
 
+/*
+ * Account probe which started lag_us after it was due, took probe_us and
+ * held ProcArrayLock for lock_us in collector stats, along with the current
+ * state of history ring.
+ */
+static void
+update_stats(History *observations, int64 lag_us, int64 probe_us,
+			 int64 lock_us, uint64 missed)
+{
+	CollectorStats *stats = &shard->stats;
+	int			bucket = 0;
+
+	while (bucket < WAIT_HISTOGRAM_BUCKETS - 1 && probe_us >= ((int64) 2 << bucket))
+		bucket++;
+
+	stats->changecount++;
+	pg_write_barrier();
+	stats->ticks++;
+	stats->missedTicks += missed;
+	stats->lagTimeUs += (uint64) lag_us;
+	stats->lagMaxUs = Max(stats->lagMaxUs, (uint64) lag_us);
+	stats->probeTimeUs += (uint64) probe_us;
+	stats->probeMaxUs = Max(stats->probeMaxUs, (uint64) probe_us);
+	stats->probeBuckets[bucket]++;
+	stats->lockTimeUs += (uint64) lock_us;
+	stats->historyWritten = observations->base +
+		pg_atomic_read_u64(&observations->ring->head);
+	stats->historyOverwritten = observations->base +
+		pg_atomic_read_u64(&observations->ring->tail);
+	stats->historyCapacity = observations->ring->capacity;
+	pg_write_barrier();
+	stats->changecount++;
 }
 
 /*
@@ -323,13 +1550,18 @@ millisecs_diff(TimestampTz tz1, TimestampTz tz2)
 void
 pgws_collector_main(Datum main_arg)
 {
-	HTAB		   *profile_hash = NULL;
 	History			observations;
+	ActiveProcs		active;
+	ProcWait	   *waits;
+	ProcSample	   *samples;
 	MemoryContext	old_context,
 					collector_context;
-	TimestampTz		current_ts,
-					history_ts,
-					profile_ts;
+	int64			history_us,
+					profile_us,
+					capture_us,
+					profiled_us,
+					weight_carry = 0;
+	int				level = 0;
 
 	/*
 	 * Establish signal handlers.
@@ -357,61 +1589,116 @@ pgws_collector_main(Datum main_arg)
 	/* Make pg_wait_sampling recognisable in pg_stat_activity */
 	pgstat_report_appname("pg_wait_sampling collector");
 
-	profile_hash = make_profile_hash();
-	pgws_collector_hdr->latch = &MyProc->procLatch;
+	shard_no = DatumGetInt32(main_arg);
+	shard_count = pgws_collector_hdr->nshards;
+	shard = &pgws_collector_hdr->shards[shard_no];
 
 	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_wait_sampling collector");
 	collector_context = AllocSetContextCreate(TopMemoryContext,
 			"pg_wait_sampling context", ALLOCSET_DEFAULT_SIZES);
 	old_context = MemoryContextSwitchTo(collector_context);
 	alloc_history(&observations, pgws_collector_hdr->historySize);
+	publish_history(&observations);
+	observations.batch = pgws_history_batch_create(ProcGlobal->allProcCount);
+	active.procnos = (int *) palloc(sizeof(int) * ProcGlobal->allProcCount);
+	active.count = 0;
+	active.refresh_ts = 0;
+	waits = (ProcWait *) palloc0(sizeof(ProcWait) * ProcGlobal->allProcCount);
+	samples = (ProcSample *) palloc(sizeof(ProcSample) *
+									(ProcGlobal->allProcCount / shard_count + 1));
 	MemoryContextSwitchTo(old_context);
 
 	ereport(LOG, (errmsg("pg_wait_sampling collector started")));
 
-	/* Start counting time for history and profile samples */
-	profile_ts = history_ts = GetCurrentTimestamp();
+	/* Start counting time for history, profile and capture samples */
+	history_us = profile_us = capture_us = profiled_us = monotonic_us();
 
 	while (1)
 	{
-		int				rc;
-		shm_mq_handle  *mqh;
-		int64			history_diff,
-						profile_diff;
-		int				history_period,
-						profile_period;
-		bool			write_history,
-						write_profile;
+		int64			now_us,
+						history_period,
+						profile_period,
+						capture_period,
+						timeout;
+		bool			capturing,
+						write_history,
+						write_profile,
+						write_capture;
 
 		/* We need an explicit call for at least ProcSignal notifications. */
 		CHECK_FOR_INTERRUPTS();
 
-		/* Wait calculate time to next sample for history or profile */
-		current_ts = GetCurrentTimestamp();
-
-		history_diff = millisecs_diff(history_ts, current_ts);
-		profile_diff = millisecs_diff(profile_ts, current_ts);
-		history_period = pgws_collector_hdr->historyPeriod;
-		profile_period = pgws_collector_hdr->profilePeriod;
+		if (!pgws_collector_hdr->adaptiveSampling)
+			level = 0;
+		history_period = sampling_period(pgws_collector_hdr->historyPeriod, level);
+		profile_period = sampling_period(pgws_collector_hdr->profilePeriod, level);
+		capture_period = sampling_period(pgws_collector_hdr->capturePeriod, 0);
 
-		write_history = (history_diff >= (int64)history_period);
-		write_profile = (profile_diff >= (int64)profile_period);
-
-		if (write_history || write_profile)
+		/*
+		 * Check whether next sample of history, profile or capture is due.
+		 * Capture samples go once a period since capture was seen started.
+		 */
+		now_us = monotonic_us();
+		capturing = (shard->captureRing != NULL &&
+					 pgws_collector_hdr->captureState == CAPTURE_ACTIVE);
+		if (!capturing)
+			capture_us = now_us;
+		write_history = (now_us - history_us >= history_period);
+		write_profile = (now_us - profile_us >= profile_period);
+		write_capture = capturing && (now_us - capture_us >= capture_period);
+
+		if (write_history || write_profile || write_capture)
 		{
-			probe_waits(&observations, profile_hash,
-						write_history, write_profile, pgws_collector_hdr->profilePid);
+			int			nwaiting;
+			int64		lag_us = 0,
+						lock_us;
+			uint64		missed = 0,
+						weight = 0;
 
+			/* How late the probe starts, nothing but probes should delay it */
 			if (write_history)
+				lag_us = now_us - (history_us + history_period);
+			if (write_profile)
+				lag_us = Max(lag_us, now_us - (profile_us + profile_period));
+			if (write_capture)
+				lag_us = Max(lag_us, now_us - (capture_us + capture_period));
+
+			/* Weigh profile samples by the time actually passed since last */
+			if (write_profile)
 			{
-				history_ts = current_ts;
-				history_diff = 0;
+				weight = profile_weight(now_us - profiled_us,
+										pgws_collector_hdr->profilePeriod,
+										&weight_carry);
+				profiled_us = now_us;
 			}
 
+			nwaiting = probe_waits(&observations, &active, waits, samples,
+								   write_history, write_profile, write_capture,
+								   pgws_collector_hdr->profilePid, weight,
+								   &lock_us);
+
+			if (write_history)
+				history_us = schedule_next(history_us + history_period,
+										   now_us, history_period, &missed);
 			if (write_profile)
+				profile_us = schedule_next(profile_us + profile_period,
+										   now_us, profile_period, &missed);
+			if (write_capture)
+				capture_us = schedule_next(capture_us + capture_period,
+										   now_us, capture_period, &missed);
+
+			update_stats(&observations, lag_us, monotonic_us() - now_us,
+						 lock_us, missed);
+
+			/* Adapt sampling rate to the waits just seen */
+			if (pgws_collector_hdr->adaptiveSampling)
 			{
-				profile_ts = current_ts;
-				profile_diff = 0;
+				level = adaptive_level(nwaiting,
+									   pgws_collector_hdr->adaptiveThreshold);
+				history_period = sampling_period(pgws_collector_hdr->historyPeriod,
+												 level);
+				profile_period = sampling_period(pgws_collector_hdr->profilePeriod,
+												 level);
 			}
 		}
 
@@ -419,81 +1706,50 @@ pgws_collector_main(Datum main_arg)
 		if (shutdown_requested)
 			break;
 
-		/*
-		 * Wait until next sample time or request to do something through
-		 * shared memory.
-		 */
+		timeout = Min(history_us + history_period,
+					  profile_us + profile_period);
+		/* The probe might have just fired capture */
+		if (shard->captureRing != NULL &&
+			pgws_collector_hdr->captureState == CAPTURE_ACTIVE)
+			timeout = Min(timeout, capture_us + capture_period);
+		timeout -= monotonic_us();
+
+		if (timeout >= 1000)
+		{
+			int			rc;
+
+			/*
+			 * Wait until the millisecond before next sample time or request
+			 * to do something through shared memory.  The rest is slept on
+			 * the next loop.
+			 */
 #if PG_VERSION_NUM >= 100000
-		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-				Min(history_period - (int)history_diff,
-					profile_period - (int)profile_diff), PG_WAIT_EXTENSION);
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   (long) (timeout / 1000), PG_WAIT_EXTENSION);
 #else
-		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-				Min(history_period - (int)history_diff,
-					profile_period - (int)profile_diff));
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   (long) (timeout / 1000));
 #endif
 
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
-
-		ResetLatch(&MyProc->procLatch);
-
-		/* Handle request if any */
-		if (pgws_collector_hdr->request != NO_REQUEST)
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+		}
+		else
 		{
-			LOCKTAG		tag;
-			SHMRequest	request;
-
-			pgws_init_lock_tag(&tag, PGWS_COLLECTOR_LOCK);
-
-			LockAcquire(&tag, ExclusiveLock, false, false);
-			request = pgws_collector_hdr->request;
-			pgws_collector_hdr->request = NO_REQUEST;
-
-			if (request == HISTORY_REQUEST || request == PROFILE_REQUEST)
-			{
-				shm_mq_result	mq_result;
-
-				/* Send history or profile */
-				shm_mq_set_sender(pgws_collector_mq, MyProc);
-				mqh = shm_mq_attach(pgws_collector_mq, NULL, NULL);
-				mq_result = shm_mq_wait_for_attach(mqh);
-				switch (mq_result)
-				{
-					case SHM_MQ_SUCCESS:
-						switch (request)
-						{
-							case HISTORY_REQUEST:
-								send_history(&observations, mqh);
-								break;
-							case PROFILE_REQUEST:
-								send_profile(profile_hash, mqh);
-								break;
-							default:
-								Assert(false);
-						}
-						break;
-					case SHM_MQ_DETACHED:
-						ereport(WARNING,
-								(errmsg("pg_wait_sampling collector: "
-										"receiver of message queue have been "
-										"detached")));
-						break;
-					default:
-						Assert(false);
-				}
-				shm_mq_detach_compat(mqh, pgws_collector_mq);
-			}
-			else if (request == PROFILE_RESET)
-			{
-				/* Reset profile hash */
-				hash_destroy(profile_hash);
-				profile_hash = make_profile_hash();
-			}
-			LockRelease(&tag, ExclusiveLock, false);
+			/* WaitLatch() can't sleep less than a millisecond */
+			if (timeout > 0)
+				pg_usleep((long) timeout);
+			if (!PostmasterIsAlive())
+				proc_exit(1);
 		}
+
+		ResetLatch(&MyProc->procLatch);
 	}
 
+	shard->historyHandle = DSM_HANDLE_INVALID;
+	free_history(&observations);
 	MemoryContextReset(collector_context);
 
 	/*
@@ -12,10 +12,32 @@
 
 #include "postgres.h"
 
+#include <sys/stat.h>
+
 #include "access/tupdesc.h"
+#include "funcapi.h"
 #include "miscadmin.h"
-#include "storage/shm_mq.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
 #include "utils/guc_tables.h"
+#include "utils/tuplestore.h"
+
+#ifndef DSM_HANDLE_INVALID
+#define DSM_HANDLE_INVALID 0
+#endif
+
+/* Classes of wait events appeared in pgstat.h only in 10 */
+#if PG_VERSION_NUM < 100000
+#define PG_WAIT_LWLOCK				0x01000000U
+#define PG_WAIT_LOCK				0x03000000U
+#define PG_WAIT_BUFFER_PIN			0x04000000U
+#define PG_WAIT_ACTIVITY			0x05000000U
+#define PG_WAIT_CLIENT				0x06000000U
+#define PG_WAIT_EXTENSION			0x07000000U
+#define PG_WAIT_IPC					0x08000000U
+#define PG_WAIT_TIMEOUT				0x09000000U
+#define PG_WAIT_IO					0x0A000000U
+#endif
 
 static inline TupleDesc
 CreateTemplateTupleDescCompat(int nattrs, bool hasoid)
@@ -27,24 +49,39 @@ CreateTemplateTupleDescCompat(int nattrs, bool hasoid)
 #endif
 }
 
+/*
+ * Prepare materialize mode SRF: tuplestore and tuple descriptor built from
+ * the declared result type are placed into fcinfo->resultinfo.
+ */
 static inline void
-shm_mq_detach_compat(shm_mq_handle *mqh, shm_mq *mq)
+InitMaterializedSRFCompat(FunctionCallInfo fcinfo)
 {
-#if PG_VERSION_NUM >= 100000
-	shm_mq_detach(mqh);
+#if PG_VERSION_NUM >= 160000
+	InitMaterializedSRF(fcinfo, 0);
+#elif PG_VERSION_NUM >= 150000
+	SetSingleFuncCall(fcinfo, 0);
 #else
-	shm_mq_detach(mq);
-#endif
-}
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
 
-static inline shm_mq_result
-shm_mq_send_compat(shm_mq_handle *mqh, Size nbytes, const void *data,
-				   bool nowait, bool force_flush)
-{
-#if PG_VERSION_NUM >= 150000
-	return shm_mq_send(mqh, nbytes, data, nowait, force_flush);
-#else
-	return shm_mq_send(mqh, nbytes, data, nowait);
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
 #endif
 }
 
@@ -66,6 +103,26 @@ InitPostgresCompat(const char *in_dbname, Oid dboid,
 #endif
 }
 
+static inline int
+OpenTransientFileCompat(const char *fileName, int fileFlags, int fileMode)
+{
+#if PG_VERSION_NUM >= 110000
+	return OpenTransientFilePerm(fileName, fileFlags, fileMode);
+#else
+	return OpenTransientFile((char *) fileName, fileFlags, fileMode);
+#endif
+}
+
+static inline int
+MakePGDirectoryCompat(const char *directoryName)
+{
+#if PG_VERSION_NUM >= 110000
+	return MakePGDirectory(directoryName);
+#else
+	return mkdir(directoryName, S_IRWXU);
+#endif
+}
+
 static inline void
 get_guc_variables_compat(struct config_generic ***vars, int *num_vars)
 {
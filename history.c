@@ -0,0 +1,788 @@
+/*
+ * history.c
+ *		Compact encoding of waits history ring.
+ *
+ * Copyright (c) 2015-2017, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_wait_sampling/history.c
+ */
+#include "postgres.h"
+
+#include "pgstat.h"
+
+#include "compat.h"
+#include "pg_wait_sampling.h"
+
+/*
+ * Every probe of waits is stored in the ring as a batch: HistoryBatchHeader
+ * with the sample timestamp followed by entries of the form
+ *
+ *	varint	pid
+ *	byte	class of wait event (wait_event_info >> 24)
+ *	varint	id of wait event (lower 24 bits of wait_event_info)
+ *	varint	queryId reference: 0 means no query, 1..n stands for n-th
+ *			queryId already met in the batch, n + 1 is a new one and is
+ *			followed by 8 bytes of queryId
+ *
+ * Entries of heavyweight lock waits also have
+ *
+ *	varint	0 if the lock is unknown, blocker pid + 1 otherwise, followed by
+ *			bytes of lock tag type and lock method and varints of lock tag
+ *			fields
+ *
+ * Usually an entry takes 6-7 bytes, several times less than HistoryItem.
+ * Multi-byte values are copied with memcpy() since they are not aligned.
+ */
+#define HISTORY_LOCK_MAX_SIZE	(5 + 2 + 5 * 3 + 3)
+#define HISTORY_ENTRY_MAX_SIZE	(5 + 1 + 4 + 5 + sizeof(uint64) + \
+								 HISTORY_LOCK_MAX_SIZE)
+
+struct HistoryBatch
+{
+	char	   *buf;
+	Size		len;
+	Size		limit;			/* can't exceed capacity of the largest ring */
+	Size		maxlen;
+	uint32		nitems;
+	uint32	   *ends;			/* batch length after every sample */
+	TimestampTz	ts;
+
+	/*
+	 * Dictionary of queryIds met in the batch.  Open-addressing hash table,
+	 * whose slots are valid only if their stamp matches the current one, so
+	 * it doesn't need to be cleared for every batch.
+	 */
+	uint32		ndict;
+	uint32		dictMask;
+	uint32		stamp;
+	uint64	   *dictKeys;
+	uint32	   *dictIds;
+	uint32	   *dictStamps;
+};
+
+static inline char *
+encode_varint(char *p, uint32 value)
+{
+	while (value >= 0x80)
+	{
+		*p++ = (char) (value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (char) value;
+	return p;
+}
+
+/* Returns NULL if the value runs past end */
+static inline const char *
+decode_varint(const char *p, const char *end, uint32 *value)
+{
+	uint32		result = 0;
+	int			shift = 0;
+
+	while (p < end && shift < 32)
+	{
+		uint8		b = (uint8) *p++;
+
+		result |= (uint32) (b & 0x7F) << shift;
+		if ((b & 0x80) == 0)
+		{
+			*value = result;
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+/*
+ * Copy bytes from the ring starting at given absolute position.
+ */
+static void
+ring_read(HistoryRing *ring, uint64 pos, void *dst, Size len)
+{
+	Size		offset = pos % ring->capacity,
+				first = Min(len, ring->capacity - offset);
+
+	memcpy(dst, ring->data + offset, first);
+	memcpy((char *) dst + first, ring->data, len - first);
+}
+
+/*
+ * Copy bytes into the ring starting at given absolute position.
+ */
+static void
+ring_write(HistoryRing *ring, uint64 pos, const void *src, Size len)
+{
+	Size		offset = pos % ring->capacity,
+				first = Min(len, ring->capacity - offset);
+
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+/*
+ * Size of DSM segment for history ring of given capacity in bytes.
+ */
+Size
+pgws_history_ring_size(Size capacity)
+{
+	return offsetof(HistoryRing, data) + capacity;
+}
+
+void
+pgws_history_init(HistoryRing *ring, Size capacity)
+{
+	ring->magic = PG_WAIT_SAMPLING_MAGIC;
+	ring->capacity = capacity;
+	pg_atomic_init_u64(&ring->tail, 0);
+	pg_atomic_init_u64(&ring->head, 0);
+}
+
+/*
+ * Put len bytes of whole batches at the head of the ring, evicting the
+ * oldest batches to make room.
+ */
+static void
+ring_push(HistoryRing *ring, const char *buf, Size len)
+{
+	uint64		head = pg_atomic_read_u64(&ring->head),
+				tail = pg_atomic_read_u64(&ring->tail);
+
+	while (head + len - tail > ring->capacity)
+	{
+		HistoryBatchHeader old;
+
+		ring_read(ring, tail, &old, sizeof(old));
+		tail += old.length;
+	}
+
+	/* Readers must see that the data is gone before we overwrite it */
+	pg_atomic_write_u64(&ring->tail, tail);
+	pg_write_barrier();
+	ring_write(ring, head, buf, len);
+	pg_write_barrier();
+	pg_atomic_write_u64(&ring->head, head + len);
+}
+
+/*
+ * Move batches of src starting at position from to the ring dst, about
+ * maxBytes at once, and return position to continue from.  The copy is done
+ * when the result reaches the head of src.  Batches evicted from src
+ * meanwhile are skipped, as well as the older ones which wouldn't fit into
+ * dst anyway, so dst ends up with the most recent batches in the order they
+ * were written.  Only the collector calls it, so src can't change meanwhile.
+ */
+uint64
+pgws_history_copy_chunk(HistoryRing *dst, HistoryRing *src, uint64 from,
+						Size maxBytes)
+{
+	uint64		head = pg_atomic_read_u64(&src->head),
+				pos = Max(from, pg_atomic_read_u64(&src->tail)),
+				end;
+	HistoryBatchHeader header;
+	char	   *buf;
+
+	while (head - pos > dst->capacity)
+	{
+		ring_read(src, pos, &header, sizeof(header));
+		pos += header.length;
+	}
+
+	/* At least one batch is copied, so the copy always makes progress */
+	end = pos;
+	while (end < head)
+	{
+		ring_read(src, end, &header, sizeof(header));
+		if (end > pos && end - pos + header.length > maxBytes)
+			break;
+		end += header.length;
+	}
+
+	if (end == pos)
+		return pos;
+
+	buf = (char *) palloc(end - pos);
+	ring_read(src, pos, buf, end - pos);
+	ring_push(dst, buf, end - pos);
+	pfree(buf);
+
+	return end;
+}
+
+/*
+ * Allocate batch able to hold samples of maxItems processes.
+ */
+HistoryBatch *
+pgws_history_batch_create(int maxItems)
+{
+	HistoryBatch *batch = (HistoryBatch *) palloc0(sizeof(HistoryBatch));
+	uint32		dictSize = 16;
+
+	while (dictSize < (uint32) maxItems * 2)
+		dictSize <<= 1;
+
+	batch->maxlen = sizeof(HistoryBatchHeader) +
+		(Size) maxItems * HISTORY_ENTRY_MAX_SIZE;
+	batch->buf = (char *) palloc(batch->maxlen);
+	batch->ends = (uint32 *) palloc(sizeof(uint32) * Max(maxItems, 1));
+	batch->dictMask = dictSize - 1;
+	batch->dictKeys = (uint64 *) palloc(sizeof(uint64) * dictSize);
+	batch->dictIds = (uint32 *) palloc(sizeof(uint32) * dictSize);
+	batch->dictStamps = (uint32 *) palloc0(sizeof(uint32) * dictSize);
+	return batch;
+}
+
+/*
+ * Start new batch of samples taken at ts for rings of up to given capacity.
+ */
+void
+pgws_history_batch_begin(HistoryBatch *batch, TimestampTz ts, Size capacity)
+{
+	batch->len = sizeof(HistoryBatchHeader);
+	batch->limit = Min(batch->maxlen, capacity);
+	batch->nitems = 0;
+	batch->ts = ts;
+	batch->ndict = 0;
+
+	/* Invalidate dictionary, clearing it once the stamp wraps around */
+	if (++batch->stamp == 0)
+	{
+		MemSet(batch->dictStamps, 0, sizeof(uint32) * (batch->dictMask + 1));
+		batch->stamp = 1;
+	}
+}
+
+/*
+ * Encode sample into the batch.  Returns false if there is no room left.
+ */
+bool
+pgws_history_batch_add(HistoryBatch *batch, const HistoryItem *item)
+{
+	char	   *p = batch->buf + batch->len;
+
+	if (batch->len + HISTORY_ENTRY_MAX_SIZE > batch->limit)
+		return false;
+
+	p = encode_varint(p, item->pid);
+	*p++ = (char) (item->wait_event_info >> 24);
+	p = encode_varint(p, item->wait_event_info & 0xFFFFFF);
+
+	if (item->queryId == 0)
+		p = encode_varint(p, 0);
+	else
+	{
+		uint32		i;
+
+		i = (uint32) ((item->queryId * UINT64CONST(0x9E3779B97F4A7C15)) >> 32) &
+			batch->dictMask;
+		for (;;)
+		{
+			if (batch->dictStamps[i] != batch->stamp)
+			{
+				/* New queryId goes to the batch in full */
+				batch->dictStamps[i] = batch->stamp;
+				batch->dictKeys[i] = item->queryId;
+				batch->dictIds[i] = ++batch->ndict;
+				p = encode_varint(p, batch->ndict);
+				memcpy(p, &item->queryId, sizeof(uint64));
+				p += sizeof(uint64);
+				break;
+			}
+			if (batch->dictKeys[i] == item->queryId)
+			{
+				p = encode_varint(p, batch->dictIds[i]);
+				break;
+			}
+			i = (i + 1) & batch->dictMask;
+		}
+	}
+
+	if ((item->wait_event_info & 0xFF000000) == PG_WAIT_LOCK)
+	{
+		if (!item->hasLockInfo)
+			p = encode_varint(p, 0);
+		else
+		{
+			p = encode_varint(p, item->blockerPid + 1);
+			*p++ = (char) item->locktag.locktag_type;
+			*p++ = (char) item->locktag.locktag_lockmethodid;
+			p = encode_varint(p, item->locktag.locktag_field1);
+			p = encode_varint(p, item->locktag.locktag_field2);
+			p = encode_varint(p, item->locktag.locktag_field3);
+			p = encode_varint(p, item->locktag.locktag_field4);
+		}
+	}
+
+	batch->len = p - batch->buf;
+	batch->ends[batch->nitems++] = (uint32) batch->len;
+	return true;
+}
+
+/*
+ * Number of the first samples of the batch which take at most maxBytes.
+ * Samples refer only to queryIds of the samples before them, so the samples
+ * counted make a valid batch on their own.
+ */
+static uint32
+batch_fit(HistoryBatch *batch, Size maxBytes)
+{
+	uint32		nitems = batch->nitems;
+
+	while (nitems > 0 && batch->ends[nitems - 1] > maxBytes)
+		nitems--;
+	return nitems;
+}
+
+/*
+ * Put first nitems samples of the batch to the ring as a batch of their own.
+ */
+static void
+batch_push(HistoryRing *ring, HistoryBatch *batch, uint32 nitems)
+{
+	HistoryBatchHeader header;
+
+	Assert(nitems > 0 && nitems <= batch->nitems);
+	header.length = batch->ends[nitems - 1];
+	header.nitems = nitems;
+	header.ts = batch->ts;
+	memcpy(batch->buf, &header, sizeof(header));
+
+	ring_push(ring, batch->buf, header.length);
+}
+
+/*
+ * Put the batch to the ring, dropping the oldest batches to make room.  The
+ * batch is cropped to the samples which fit the ring if it's encoded for a
+ * larger one.  Empty batches are not stored.
+ */
+void
+pgws_history_append(HistoryRing *ring, HistoryBatch *batch)
+{
+	uint32		nitems = batch_fit(batch, ring->capacity);
+
+	if (nitems > 0)
+		batch_push(ring, batch, nitems);
+}
+
+/*
+ * Put the batch to the ring without dropping older batches, cropping it to
+ * the samples which fit the room left.  Returns false if some of them don't.
+ */
+bool
+pgws_history_append_no_evict(HistoryRing *ring, HistoryBatch *batch)
+{
+	uint64		head = pg_atomic_read_u64(&ring->head),
+				tail = pg_atomic_read_u64(&ring->tail);
+	uint32		nitems = batch_fit(batch, ring->capacity - (head - tail));
+
+	if (nitems > 0)
+		batch_push(ring, batch, nitems);
+	return nitems == batch->nitems;
+}
+
+/*
+ * Decode single entry.  Returns NULL if the entry is malformed.
+ */
+static const char *
+decode_entry(const char *p, const char *end, HistoryItem *item,
+			 uint64 *dict, uint32 *ndict)
+{
+	uint32		pid,
+				eventId,
+				ref;
+	uint8		classId;
+
+	if ((p = decode_varint(p, end, &pid)) == NULL || p >= end)
+		return NULL;
+	classId = (uint8) *p++;
+	if ((p = decode_varint(p, end, &eventId)) == NULL ||
+		(p = decode_varint(p, end, &ref)) == NULL)
+		return NULL;
+
+	item->pid = pid;
+	item->wait_event_info = ((uint32) classId << 24) | eventId;
+	if (ref == 0)
+		item->queryId = 0;
+	else if (ref <= *ndict)
+		item->queryId = dict[ref - 1];
+	else if (ref == *ndict + 1 && end - p >= (ptrdiff_t) sizeof(uint64))
+	{
+		memcpy(&item->queryId, p, sizeof(uint64));
+		p += sizeof(uint64);
+		dict[(*ndict)++] = item->queryId;
+	}
+	else
+		return NULL;
+
+	item->hasLockInfo = false;
+	if ((item->wait_event_info & 0xFF000000) == PG_WAIT_LOCK)
+	{
+		uint32		blocker,
+					field4;
+
+		if ((p = decode_varint(p, end, &blocker)) == NULL)
+			return NULL;
+		if (blocker != 0)
+		{
+			if (end - p < 2)
+				return NULL;
+			item->locktag.locktag_type = (uint8) *p++;
+			item->locktag.locktag_lockmethodid = (uint8) *p++;
+			if ((p = decode_varint(p, end, &item->locktag.locktag_field1)) == NULL ||
+				(p = decode_varint(p, end, &item->locktag.locktag_field2)) == NULL ||
+				(p = decode_varint(p, end, &item->locktag.locktag_field3)) == NULL ||
+				(p = decode_varint(p, end, &field4)) == NULL)
+				return NULL;
+			item->locktag.locktag_field4 = (uint16) field4;
+			item->blockerPid = blocker - 1;
+			item->hasLockInfo = true;
+		}
+	}
+
+	return p;
+}
+
+/*
+ * Position of the first batch taken after ts in the ring part starting at
+ * given position, which is either 0 or the end of a batch.  Only headers of
+ * the batches before it are read, so that a reader which already has them
+ * doesn't copy them again.
+ */
+uint64
+pgws_history_seek(HistoryRing *ring, uint64 from, TimestampTz ts)
+{
+	uint64		head,
+				pos;
+
+	head = pg_atomic_read_u64(&ring->head);
+	pg_read_barrier();
+	pos = Max(pg_atomic_read_u64(&ring->tail), from);
+	while (pos < head)
+	{
+		HistoryBatchHeader header;
+		uint64		tail;
+
+		ring_read(ring, pos, &header, sizeof(header));
+		pg_read_barrier();
+		tail = pg_atomic_read_u64(&ring->tail);
+
+		/* The header could be overwritten, go on from the new tail */
+		if (tail > pos)
+		{
+			pos = tail;
+			continue;
+		}
+		if (header.ts > ts || header.length < sizeof(header))
+			break;
+		pos += header.length;
+	}
+	return pos;
+}
+
+/*
+ * Copy consistent snapshot of the ring part starting at given position,
+ * which is either 0 or the end of a batch returned before.  Batches
+ * overwritten by the collector during the copy are skipped.  Returns raw
+ * batches and sets *next to position to continue from.
+ */
+char *
+pgws_history_read_raw(HistoryRing *ring, uint64 from, uint64 *next, Size *len)
+{
+	uint64		head,
+				tail,
+				newTail;
+	char	   *buf;
+
+	head = pg_atomic_read_u64(&ring->head);
+	pg_read_barrier();
+	tail = pg_atomic_read_u64(&ring->tail);
+	tail = Max(tail, from);
+	if (tail >= head)
+	{
+		*next = Max(head, from);
+		*len = 0;
+		return (char *) palloc(1);
+	}
+
+	buf = (char *) palloc(head - tail);
+	ring_read(ring, tail, buf, head - tail);
+	pg_read_barrier();
+	newTail = pg_atomic_read_u64(&ring->tail);
+
+	/* Anything before the new tail may be already overwritten */
+	if (newTail > tail)
+	{
+		Size		skip = Min(newTail - tail, head - tail);
+
+		memmove(buf, buf + skip, head - tail - skip);
+		tail += skip;
+	}
+
+	*next = head;
+	*len = head - tail;
+	return buf;
+}
+
+/*
+ * Check whether decoded sample passes the filter.  Names of the last wait
+ * event are cached, since consecutive samples often share it.
+ */
+static bool
+filter_match(const HistoryFilter *filter, const HistoryItem *item,
+			 uint32 *cachedEvent, bool *cachedMatch)
+{
+	if (filter->pid != 0 && item->pid != (uint32) filter->pid)
+		return false;
+	if (filter->hasQueryId && item->queryId != filter->queryId)
+		return false;
+
+	if (filter->eventType == NULL && filter->event == NULL)
+		return true;
+
+	if (item->wait_event_info != *cachedEvent)
+	{
+		const char *eventType = pgstat_get_wait_event_type(item->wait_event_info),
+				   *event = pgstat_get_wait_event(item->wait_event_info);
+
+		*cachedEvent = item->wait_event_info;
+		*cachedMatch =
+			(filter->eventType == NULL ||
+			 (eventType != NULL && pg_strcasecmp(eventType, filter->eventType) == 0)) &&
+			(filter->event == NULL ||
+			 (event != NULL && pg_strcasecmp(event, filter->event) == 0));
+	}
+	return *cachedMatch;
+}
+
+/*
+ * Decode batches into items in the order they were written, keeping only
+ * those passing the filter, if any.  Batches taken before filter->since are
+ * skipped without decoding.  Decoding stops at the first malformed or
+ * truncated batch, and a warning is reported if it met a malformed sample.
+ */
+HistoryItem *
+pgws_history_decode(const char *buf, Size len, const HistoryFilter *filter,
+					Size *count)
+{
+	const char *p,
+			   *end = buf + len;
+	HistoryItem *result;
+	uint64	   *dict;
+	Size		n = 0,
+				nitems = 0,
+				allocated;
+	uint32		maxBatchItems = 0,
+				cachedEvent = 0;
+	bool		cachedMatch = false;
+
+	/* Count items to allocate the result */
+	p = buf;
+	while (end - p >= (ptrdiff_t) sizeof(HistoryBatchHeader))
+	{
+		HistoryBatchHeader header;
+
+		memcpy(&header, p, sizeof(header));
+		if (header.length < sizeof(header) || header.length > end - p)
+			break;
+		if (filter == NULL || !filter->hasSince || header.ts >= filter->since)
+		{
+			nitems += header.nitems;
+			maxBatchItems = Max(maxBatchItems, header.nitems);
+		}
+		p += header.length;
+	}
+
+	/* Filtered result is usually much smaller, so grow it on demand */
+	allocated = (filter != NULL) ? Min(nitems, 256) : nitems;
+	allocated = Max(allocated, 1);
+	result = (HistoryItem *) palloc(sizeof(HistoryItem) * allocated);
+	dict = (uint64 *) palloc(sizeof(uint64) * Max(maxBatchItems, 1));
+
+	p = buf;
+	while (end - p >= (ptrdiff_t) sizeof(HistoryBatchHeader))
+	{
+		HistoryBatchHeader header;
+		HistoryItem item;
+		const char *q,
+				   *batchEnd;
+		uint32		ndict = 0,
+					i;
+
+		memcpy(&header, p, sizeof(header));
+		if (header.length < sizeof(header) || header.length > end - p)
+			break;
+
+		q = p + sizeof(header);
+		batchEnd = p + header.length;
+		p = batchEnd;
+		if (filter != NULL && filter->hasSince && header.ts < filter->since)
+			continue;
+
+		for (i = 0; i < header.nitems; i++)
+		{
+			q = decode_entry(q, batchEnd, &item, dict, &ndict);
+			if (q == NULL)
+				break;
+			if (filter != NULL &&
+				!filter_match(filter, &item, &cachedEvent, &cachedMatch))
+				continue;
+
+			if (n >= allocated)
+			{
+				allocated *= 2;
+				result = (HistoryItem *) repalloc(result,
+												  sizeof(HistoryItem) * allocated);
+			}
+			item.ts = header.ts;
+			result[n++] = item;
+		}
+		if (i < header.nitems)
+		{
+			ereport(WARNING,
+					(errmsg("waits history is truncated at malformed batch taken at %s",
+							timestamptz_to_str(header.ts))));
+			break;
+		}
+	}
+
+	pfree(dict);
+
+	*count = n;
+	return result;
+}
+
+/*
+ * Copy consistent snapshot of whole batches of the ring starting at from,
+ * which is either 0 or a batch boundary, up to end.  About maxBytes are
+ * copied, but at least one batch.  Batches overwritten by the collector
+ * before the copy are skipped.  Returns raw batches, or NULL if there is
+ * nothing left, and sets *next to position to continue from.
+ */
+static char *
+read_chunk(HistoryRing *ring, uint64 from, uint64 end, Size maxBytes,
+		   uint64 *next, Size *len)
+{
+	for (;;)
+	{
+		HistoryBatchHeader header;
+		uint64		start = Max(pg_atomic_read_u64(&ring->tail), from);
+		Size		copied,
+					n = 0;
+		char	   *buf;
+
+		*next = end;
+		*len = 0;
+		if (start >= end)
+			return NULL;
+
+		copied = Min(end - start, maxBytes);
+		buf = (char *) palloc(copied);
+		ring_read(ring, start, buf, copied);
+		pg_read_barrier();
+
+		/* Start of the copy may be already overwritten, retry after it */
+		if (pg_atomic_read_u64(&ring->tail) > start)
+		{
+			pfree(buf);
+			continue;
+		}
+
+		while (copied - n >= sizeof(header))
+		{
+			memcpy(&header, buf + n, sizeof(header));
+			if (header.length < sizeof(header) || header.length > copied - n)
+				break;
+			n += header.length;
+		}
+
+		if (n > 0)
+		{
+			*next = start + n;
+			*len = n;
+			return buf;
+		}
+		pfree(buf);
+
+		/* Retry with room for the first batch, unless it's malformed */
+		if (copied < sizeof(header))
+			return NULL;
+		if (header.length < sizeof(header) || header.length > end - start)
+		{
+			ereport(WARNING,
+					(errmsg("waits history is truncated at malformed batch of %u bytes",
+							(unsigned int) header.length)));
+			return NULL;
+		}
+		maxBytes = header.length;
+	}
+}
+
+/*
+ * Reader of waits history ring by chunks of bounded size, so that a large
+ * history isn't copied out at once.  It reads samples written before it was
+ * opened, skipping those overwritten before their chunk is read.
+ */
+struct HistoryCursor
+{
+	HistoryRing		   *ring;
+	const HistoryFilter *filter;
+	Size				chunkSize;
+	uint64				pos;		/* where the next chunk starts */
+	uint64				end;		/* head of the ring at open */
+	HistoryItem		   *items;		/* decoded chunk */
+	Size				nitems;
+	Size				next;
+};
+
+HistoryCursor *
+pgws_history_cursor_open(HistoryRing *ring, const HistoryFilter *filter,
+						 Size chunkSize)
+{
+	HistoryCursor *cursor = (HistoryCursor *) palloc0(sizeof(HistoryCursor));
+
+	cursor->ring = ring;
+	cursor->filter = filter;
+	cursor->chunkSize = chunkSize;
+	cursor->pos = 0;
+	cursor->end = pg_atomic_read_u64(&ring->head);
+	pg_read_barrier();
+	return cursor;
+}
+
+/*
+ * Next sample passing the filter in the order they were written, or NULL if
+ * there are no more.  Returned item is valid until the next call.
+ */
+HistoryItem *
+pgws_history_cursor_next(HistoryCursor *cursor)
+{
+	while (cursor->next >= cursor->nitems)
+	{
+		char	   *buf;
+		Size		len;
+
+		if (cursor->items)
+			pfree(cursor->items);
+		cursor->items = NULL;
+		cursor->nitems = cursor->next = 0;
+
+		buf = read_chunk(cursor->ring, cursor->pos, cursor->end,
+						 cursor->chunkSize, &cursor->pos, &len);
+		if (buf == NULL)
+			return NULL;
+		cursor->items = pgws_history_decode(buf, len, cursor->filter,
+											&cursor->nitems);
+		pfree(buf);
+	}
+
+	return &cursor->items[cursor->next++];
+}
+
+void
+pgws_history_cursor_close(HistoryCursor *cursor)
+{
+	if (cursor->items)
+		pfree(cursor->items);
+	pfree(cursor);
+}
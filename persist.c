@@ -0,0 +1,752 @@
+/*
+ * persist.c
+ *		Persistent store of waits history.
+ *
+ * Copyright (c) 2015-2017, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_wait_sampling/persist.c
+ */
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "pgstat.h"
+
+#include "compat.h"
+#include "pg_wait_sampling.h"
+
+/*
+ * History of every collector shard is stored in $PGDATA/pg_wait_sampling as
+ * a sequence of segment files, each named by the shard number and the
+ * timestamp of its first batch in hex, so that names sort by shard and then
+ * in time order.  Batches of a shard go in time order, while batches of
+ * different shards are flushed in turns, so they are ordered by time only
+ * within their shard's stream.  Segments contain the batches exactly as they
+ * are encoded in the ring.  A batch partially written on crash is detected
+ * by its length and ignored.
+ */
+#define PERSIST_DIR				"pg_wait_sampling"
+#define SEGMENT_PREFIX			"history."
+#define SEGMENT_PREFIX_LEN		(sizeof(SEGMENT_PREFIX) - 1)
+#define SEGMENT_NAME_LEN		(SEGMENT_PREFIX_LEN + 3 + 16)
+
+/* Size of the buffer segments are read through, grown for larger batches */
+#define STREAM_BUFFER_SIZE		(64 * 1024)
+
+static volatile sig_atomic_t shutdown_requested = false;
+static volatile sig_atomic_t got_sighup = false;
+
+/*
+ * Position of the flusher in history ring of collector shard, and the
+ * segment file of the shard being written.
+ */
+typedef struct
+{
+	dsm_handle		handle;		/* history segment we read */
+	uint64			pos;		/* position in its ring already read */
+	TimestampTz		last_ts;	/* timestamp of the last flushed batch */
+	int				fd;			/* current segment file, or -1 */
+	char			path[MAXPGPATH];
+	Size			size;
+} FlusherShard;
+
+/*
+ * State of the flusher.
+ */
+typedef struct
+{
+	FlusherShard   *shards;
+} Flusher;
+
+/*
+ * Persisted history of one collector shard being read.  The current segment
+ * is kept open and read sequentially through the buffer.  The next batch
+ * within the range is decoded ahead, so that streams can be merged by time.
+ */
+typedef struct
+{
+	char		  **segments;	/* of the shard, in time order */
+	int				nsegments;
+	int				current;
+	int				fd;			/* of the current segment, or -1 */
+	char			path[MAXPGPATH];
+	char		   *buf;
+	Size			bufsize;
+	Size			buflen;		/* bytes of the segment read into buf */
+	Size			bufpos;		/* start of the next batch in buf */
+	HistoryItem	   *items;		/* next batch, or NULL if nothing is left */
+	Size			count;
+	TimestampTz		ts;
+} PersistStream;
+
+/*
+ * Reader of persisted history within time range, merging streams of all
+ * the shards found on disk by batch timestamp.  Segment files stay open
+ * until the reader is ended.
+ */
+struct PersistReader
+{
+	PersistStream  *streams;
+	int				nstreams;
+	TimestampTz		from;
+	TimestampTz		to;
+};
+
+static void handle_sigterm(SIGNAL_ARGS);
+static void handle_sighup(SIGNAL_ARGS);
+
+/*
+ * Register background worker flushing waits history to disk.
+ */
+void
+pgws_register_flusher(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 1;
+	worker.bgw_notify_pid = 0;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_wait_sampling");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, CppAsString(pgws_flusher_main));
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_wait_sampling flusher");
+	worker.bgw_main_arg = (Datum) 0;
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+handle_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	shutdown_requested = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+	errno = save_errno;
+}
+
+static void
+handle_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	got_sighup = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+	errno = save_errno;
+}
+
+static int
+compare_segment_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Get names of segment files sorted by shard and time.
+ */
+static char **
+list_segments(int *count)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	char	  **names;
+	int			n = 0,
+				allocated = 16;
+
+	names = (char **) palloc(sizeof(char *) * allocated);
+
+	dir = AllocateDir(PERSIST_DIR);
+	while ((de = ReadDir(dir, PERSIST_DIR)) != NULL)
+	{
+		if (strlen(de->d_name) != SEGMENT_NAME_LEN ||
+			strncmp(de->d_name, SEGMENT_PREFIX, SEGMENT_PREFIX_LEN) != 0 ||
+			de->d_name[SEGMENT_PREFIX_LEN + 2] != '.')
+			continue;
+
+		if (n >= allocated)
+		{
+			allocated *= 2;
+			names = (char **) repalloc(names, sizeof(char *) * allocated);
+		}
+		names[n++] = pstrdup(de->d_name);
+	}
+	FreeDir(dir);
+
+	qsort(names, n, sizeof(char *), compare_segment_names);
+
+	*count = n;
+	return names;
+}
+
+/*
+ * Number of collector shard whose history segment has given name.
+ */
+static int
+segment_shard(const char *name)
+{
+	char		hex[3];
+
+	memcpy(hex, name + SEGMENT_PREFIX_LEN, 2);
+	hex[2] = '\0';
+	return (int) strtol(hex, NULL, 16);
+}
+
+/*
+ * Timestamp of the first batch of segment by its name.
+ */
+static TimestampTz
+segment_start(const char *name)
+{
+	return (TimestampTz) strtoull(name + SEGMENT_PREFIX_LEN + 3, NULL, 16);
+}
+
+/*
+ * Remove the oldest segments of given shard above
+ * pg_wait_sampling.persist_segments.
+ */
+static void
+remove_old_segments(int shardno)
+{
+	char	  **names;
+	int			count,
+				first,
+				n = 0,
+				i;
+
+	names = list_segments(&count);
+	for (first = 0; first < count; first++)
+	{
+		if (segment_shard(names[first]) == shardno)
+			break;
+	}
+	while (first + n < count && segment_shard(names[first + n]) == shardno)
+		n++;
+
+	for (i = first; i < first + n - pgws_persist_segments; i++)
+	{
+		char		path[MAXPGPATH];
+
+		snprintf(path, MAXPGPATH, "%s/%s", PERSIST_DIR, names[i]);
+		if (unlink(path) < 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", path)));
+	}
+}
+
+/*
+ * Timestamp of the newest batch persisted for given shard, or 0 if there is
+ * none.  The flusher continues from it, so that batches which are still in
+ * the ring after a restart of the flusher aren't written twice.
+ */
+static TimestampTz
+last_persisted_ts(int shardno)
+{
+	char	  **names;
+	int			count,
+				i;
+	TimestampTz	result = 0;
+
+	names = list_segments(&count);
+
+	/* The last segment may have no complete batches, look at the previous */
+	for (i = count - 1; i >= 0 && result == 0; i--)
+	{
+		char		path[MAXPGPATH];
+		int			fd;
+		off_t		size,
+					offset = 0;
+		HistoryBatchHeader header;
+
+		if (segment_shard(names[i]) != shardno)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", PERSIST_DIR, names[i]);
+		fd = OpenTransientFileCompat(path, O_RDONLY | PG_BINARY, 0);
+		if (fd < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+
+		size = lseek(fd, 0, SEEK_END);
+		while (offset + (off_t) sizeof(header) <= size &&
+			   lseek(fd, offset, SEEK_SET) >= 0 &&
+			   read(fd, &header, sizeof(header)) == sizeof(header) &&
+			   header.length >= sizeof(header) &&
+			   offset + (off_t) header.length <= size)
+		{
+			result = header.ts;
+			offset += header.length;
+		}
+		CloseTransientFile(fd);
+	}
+
+	return result;
+}
+
+static void
+close_segment(FlusherShard *state)
+{
+	if (state->fd < 0)
+		return;
+
+	if (pg_fsync(state->fd) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", state->path)));
+	CloseTransientFile(state->fd);
+	state->fd = -1;
+}
+
+/*
+ * Start new segment of given shard with the batch taken at ts.
+ */
+static void
+open_segment(FlusherShard *state, int shardno, TimestampTz ts)
+{
+	close_segment(state);
+
+	snprintf(state->path, MAXPGPATH, "%s/%s%02X.%016" INT64_MODIFIER "X",
+			 PERSIST_DIR, SEGMENT_PREFIX, shardno, (uint64) ts);
+	state->fd = OpenTransientFileCompat(state->path,
+										O_WRONLY | O_CREAT | O_APPEND | PG_BINARY,
+										S_IRUSR | S_IWUSR);
+	if (state->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", state->path)));
+	state->size = 0;
+
+	remove_old_segments(shardno);
+}
+
+static void
+write_segment(FlusherShard *state, const char *data, Size len)
+{
+	if (len == 0)
+		return;
+
+	errno = 0;
+	if (write(state->fd, data, len) != (ssize_t) len)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", state->path)));
+	}
+}
+
+/*
+ * Append batches which appeared in the history ring of given collector shard
+ * since the last flush to the shard's own segments.
+ */
+static void
+flush_shard(Flusher *flusher, int shardno)
+{
+	CollectorShard *shard = &pgws_collector_hdr->shards[shardno];
+	FlusherShard *state = &flusher->shards[shardno];
+	dsm_handle	handle = ((volatile CollectorShard *) shard)->historyHandle;
+	dsm_segment *seg = NULL;
+	HistoryRing *ring;
+	char	   *buf;
+	const char *p,
+			   *end,
+			   *chunk = NULL;
+	Size		len;
+
+	if (shard->shmemHistory != NULL)
+		ring = shard->shmemHistory;
+	else
+	{
+		if (handle == DSM_HANDLE_INVALID)
+			return;
+
+		/* The collector replaced the ring, positions start over */
+		if (handle != state->handle)
+		{
+			state->handle = handle;
+			state->pos = 0;
+		}
+
+		seg = dsm_attach(handle);
+		if (seg == NULL)
+			return;
+		ring = (HistoryRing *) dsm_segment_address(seg);
+		if (ring->magic != PG_WAIT_SAMPLING_MAGIC)
+		{
+			dsm_detach(seg);
+			return;
+		}
+	}
+	/*
+	 * Batches already flushed are met again after the ring is replaced or
+	 * the flusher is restarted, so they are skipped by timestamp without
+	 * copying them.
+	 */
+	state->pos = pgws_history_seek(ring, state->pos, state->last_ts);
+	buf = pgws_history_read_raw(ring, state->pos, &state->pos, &len);
+	if (seg != NULL)
+		dsm_detach(seg);
+
+	/*
+	 * Write consecutive batches at once.  Sample timestamps come from the
+	 * wall clock, which may step back, so batches past the seek are still
+	 * checked too.
+	 */
+	p = buf;
+	end = buf + len;
+	while (end - p >= (ptrdiff_t) sizeof(HistoryBatchHeader))
+	{
+		HistoryBatchHeader header;
+
+		memcpy(&header, p, sizeof(header));
+		if (header.length < sizeof(header) || header.length > end - p)
+			break;
+
+		if (header.ts <= state->last_ts)
+		{
+			if (chunk)
+				write_segment(state, chunk, p - chunk);
+			chunk = NULL;
+		}
+		else
+		{
+			if (state->fd < 0 ||
+				state->size >= (Size) pgws_persist_segment_size * 1024)
+			{
+				if (chunk)
+					write_segment(state, chunk, p - chunk);
+				chunk = NULL;
+				open_segment(state, shardno, header.ts);
+			}
+			if (!chunk)
+				chunk = p;
+			state->size += header.length;
+			state->last_ts = header.ts;
+		}
+		p += header.length;
+	}
+	if (chunk)
+		write_segment(state, chunk, p - chunk);
+
+	pfree(buf);
+}
+
+/*
+ * Append batches which appeared in history rings since the last flush.
+ */
+static void
+flush_history(Flusher *flusher)
+{
+	int			i;
+
+	for (i = 0; i < pgws_collector_hdr->nshards; i++)
+		flush_shard(flusher, i);
+}
+
+static void
+close_segments(Flusher *flusher)
+{
+	int			i;
+
+	for (i = 0; i < pgws_collector_hdr->nshards; i++)
+		close_segment(&flusher->shards[i]);
+}
+
+/*
+ * Main routine of waits history flusher.  It reads the history ring like
+ * any other reader, so the collector isn't affected by disk writes.
+ */
+void
+pgws_flusher_main(Datum main_arg)
+{
+	Flusher			flusher;
+	MemoryContext	flusher_context;
+	int				i;
+
+	pqsignal(SIGTERM, handle_sigterm);
+	pqsignal(SIGHUP, handle_sighup);
+	BackgroundWorkerUnblockSignals();
+
+	if (MakePGDirectoryCompat(PERSIST_DIR) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", PERSIST_DIR)));
+
+	flusher_context = AllocSetContextCreate(TopMemoryContext,
+			"pg_wait_sampling flusher context", ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(flusher_context);
+
+	memset(&flusher, 0, sizeof(flusher));
+	flusher.shards = (FlusherShard *)
+		MemoryContextAllocZero(TopMemoryContext,
+							   sizeof(FlusherShard) * pgws_collector_hdr->nshards);
+	for (i = 0; i < pgws_collector_hdr->nshards; i++)
+	{
+		flusher.shards[i].handle = DSM_HANDLE_INVALID;
+		flusher.shards[i].fd = -1;
+		flusher.shards[i].last_ts = last_persisted_ts(i);
+	}
+	MemoryContextReset(flusher_context);
+
+	ereport(LOG, (errmsg("pg_wait_sampling flusher started")));
+
+	while (!shutdown_requested)
+	{
+		int			rc;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		flush_history(&flusher);
+		MemoryContextReset(flusher_context);
+
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				pgws_persist_flush_period, PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				pgws_persist_flush_period);
+#endif
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		ResetLatch(&MyProc->procLatch);
+	}
+
+	/* Save what the collector wrote last */
+	flush_history(&flusher);
+	close_segments(&flusher);
+
+	ereport(LOG, (errmsg("pg_wait_sampling flusher shutting down")));
+	proc_exit(0);
+}
+
+static void
+stream_close_segment(PersistStream *stream)
+{
+	if (stream->fd >= 0)
+		CloseTransientFile(stream->fd);
+	stream->fd = -1;
+}
+
+/*
+ * Make len bytes of the current segment starting at the next batch available
+ * in the stream buffer.  Returns false if the segment ends before that.
+ */
+static bool
+stream_fill(PersistStream *stream, Size len)
+{
+	if (stream->buflen - stream->bufpos >= len)
+		return true;
+
+	/* Keep the unread part and read the following data after it */
+	memmove(stream->buf, stream->buf + stream->bufpos,
+			stream->buflen - stream->bufpos);
+	stream->buflen -= stream->bufpos;
+	stream->bufpos = 0;
+	if (len > stream->bufsize)
+	{
+		stream->bufsize = len;
+		stream->buf = (char *) repalloc(stream->buf, stream->bufsize);
+	}
+
+	while (stream->buflen < len)
+	{
+		ssize_t		nread = read(stream->fd, stream->buf + stream->buflen,
+								 stream->bufsize - stream->buflen);
+
+		if (nread < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", stream->path)));
+		if (nread == 0)
+			return false;
+		stream->buflen += nread;
+	}
+	return true;
+}
+
+/*
+ * Decode next batch of the stream within the range into stream->items, or
+ * set it to NULL if there is nothing left.  Batches of a stream go in time
+ * order, so it ends at the first batch after the range.
+ */
+static void
+stream_read_next(PersistReader *reader, PersistStream *stream)
+{
+	stream->items = NULL;
+	stream->count = 0;
+
+	while (stream->current < stream->nsegments)
+	{
+		HistoryBatchHeader header;
+		const char *batch;
+
+		if (stream->fd < 0)
+		{
+			if (segment_start(stream->segments[stream->current]) > reader->to)
+				break;
+
+			snprintf(stream->path, MAXPGPATH, "%s/%s", PERSIST_DIR,
+					 stream->segments[stream->current]);
+			stream->fd = OpenTransientFileCompat(stream->path,
+												 O_RDONLY | PG_BINARY, 0);
+			if (stream->fd < 0)
+			{
+				/* The flusher could remove the segment meanwhile */
+				if (errno == ENOENT)
+				{
+					stream->current++;
+					continue;
+				}
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not open file \"%s\": %m", stream->path)));
+			}
+			stream->buflen = 0;
+			stream->bufpos = 0;
+		}
+
+		/* The segment may end with a batch truncated on crash */
+		if (!stream_fill(stream, sizeof(header)))
+		{
+			stream_close_segment(stream);
+			stream->current++;
+			continue;
+		}
+		memcpy(&header, stream->buf + stream->bufpos, sizeof(header));
+		if (header.length < sizeof(header) || !stream_fill(stream, header.length))
+		{
+			stream_close_segment(stream);
+			stream->current++;
+			continue;
+		}
+
+		if (header.ts > reader->to)
+		{
+			stream_close_segment(stream);
+			stream->current = stream->nsegments;
+			break;
+		}
+
+		batch = stream->buf + stream->bufpos;
+		stream->bufpos += header.length;
+		if (header.ts < reader->from)
+			continue;
+
+		stream->ts = header.ts;
+		stream->items = pgws_history_decode(batch, header.length, NULL,
+											&stream->count);
+		return;
+	}
+}
+
+/*
+ * Start reading persisted batches taken within [from, to].
+ */
+PersistReader *
+pgws_persist_begin_read(TimestampTz from, TimestampTz to)
+{
+	PersistReader *reader = (PersistReader *) palloc0(sizeof(PersistReader));
+	struct stat st;
+	char	  **names = NULL;
+	int			count = 0,
+				i;
+
+	reader->from = from;
+	reader->to = to;
+	if (stat(PERSIST_DIR, &st) == 0)
+		names = list_segments(&count);
+
+	/* Split segments into streams of shards, they are sorted by shard */
+	reader->streams = (PersistStream *) palloc0(sizeof(PersistStream) * Max(count, 1));
+	for (i = 0; i < count; i++)
+	{
+		PersistStream *stream;
+
+		if (i == 0 || segment_shard(names[i]) != segment_shard(names[i - 1]))
+		{
+			stream = &reader->streams[reader->nstreams++];
+			stream->segments = &names[i];
+		}
+		else
+			stream = &reader->streams[reader->nstreams - 1];
+		stream->nsegments++;
+	}
+
+	for (i = 0; i < reader->nstreams; i++)
+	{
+		PersistStream *stream = &reader->streams[i];
+
+		stream->fd = -1;
+		stream->bufsize = STREAM_BUFFER_SIZE;
+		stream->buf = (char *) palloc(stream->bufsize);
+
+		/* Skip segments which end before the range */
+		while (stream->current + 1 < stream->nsegments &&
+			   segment_start(stream->segments[stream->current + 1]) <= from)
+			stream->current++;
+
+		stream_read_next(reader, stream);
+	}
+
+	return reader;
+}
+
+/*
+ * Decode next persisted batch within the range, the oldest one of all the
+ * streams.  Returns NULL when there is nothing left.
+ */
+HistoryItem *
+pgws_persist_read_next(PersistReader *reader, Size *count)
+{
+	PersistStream *best = NULL;
+	HistoryItem *items;
+	int			i;
+
+	for (i = 0; i < reader->nstreams; i++)
+	{
+		PersistStream *stream = &reader->streams[i];
+
+		if (stream->items != NULL && (best == NULL || stream->ts < best->ts))
+			best = stream;
+	}
+	if (best == NULL)
+		return NULL;
+
+	items = best->items;
+	*count = best->count;
+	stream_read_next(reader, best);
+	return items;
+}
+
+/*
+ * Close segment files left open by the reader.
+ */
+void
+pgws_persist_end_read(PersistReader *reader)
+{
+	int			i;
+
+	for (i = 0; i < reader->nstreams; i++)
+		stream_close_segment(&reader->streams[i]);
+}
@@ -0,0 +1,218 @@
+/* contrib/pg_wait_sampling/pg_wait_sampling--1.1--1.2.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_wait_sampling UPDATE TO '1.2'" to load this file. \quit
+
+CREATE FUNCTION pg_wait_sampling_get_profile_delta (
+	since_generation int8,
+	OUT pid int4,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8,
+	OUT count int8,
+	OUT generation int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_profile_generation (
+	OUT generation int8,
+	OUT reset_generation int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_wait_histogram (
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8,
+	OUT lower_us int8,
+	OUT upper_us int8,
+	OUT count int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_persisted_history (
+	from_ts timestamptz,
+	to_ts timestamptz,
+	OUT pid int4,
+	OUT ts timestamptz,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_profile_series (
+	from_ts timestamptz,
+	to_ts timestamptz,
+	OUT bucket_ts timestamptz,
+	OUT pid int4,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8,
+	OUT count int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_history_filtered (
+	pid int4 DEFAULT NULL,
+	queryid int8 DEFAULT NULL,
+	event_type text DEFAULT NULL,
+	event text DEFAULT NULL,
+	since timestamptz DEFAULT NULL,
+	OUT pid int4,
+	OUT ts timestamptz,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE CALLED ON NULL INPUT;
+
+CREATE FUNCTION pg_wait_sampling_get_history_raw (
+	OUT pid int4,
+	OUT ts timestamptz,
+	OUT wait_event_info int4,
+	OUT queryid int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_wait_events (
+	OUT wait_event_info int4,
+	OUT event_type text,
+	OUT event text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_lock_history (
+	OUT pid int4,
+	OUT ts timestamptz,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8,
+	OUT blocker_pid int4,
+	OUT locktype text,
+	OUT locktag_field1 int8,
+	OUT locktag_field2 int8,
+	OUT locktag_field3 int8,
+	OUT locktag_field4 int4
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_profile_topn (
+	OUT pid int4,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8,
+	OUT count int8,
+	OUT error int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_profile_extended (
+	OUT pid int4,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8,
+	OUT count int8,
+	OUT datid oid,
+	OUT roleid oid,
+	OUT backend_type text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_collector_stats (
+	OUT ticks int8,
+	OUT missed_ticks int8,
+	OUT tick_lag_us int8,
+	OUT tick_lag_max_us int8,
+	OUT probe_time_us int8,
+	OUT probe_p50_us int8,
+	OUT probe_p99_us int8,
+	OUT probe_max_us int8,
+	OUT procarray_lock_us int8,
+	OUT profile_entries int8,
+	OUT profile_overflow int8,
+	OUT profile_bytes int8,
+	OUT history_bytes int8,
+	OUT history_written_bytes int8,
+	OUT history_overwritten_bytes int8,
+	OUT shmem_bytes int8,
+	OUT reads int8,
+	OUT read_retries int8,
+	OUT queryid_dict_entries int8,
+	OUT queryid_dict_overflow int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_current_pids (
+	pids int4[],
+	OUT pid int4,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_capture (
+	OUT pid int4,
+	OUT ts timestamptz,
+	OUT event_type text,
+	OUT event text,
+	OUT queryid int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_get_capture_state (
+	OUT state text,
+	OUT start_ts timestamptz,
+	OUT end_ts timestamptz,
+	OUT event_type text,
+	OUT event text,
+	OUT waiting int4
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pg_wait_sampling_reset_capture()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_wait_sampling_reset_capture() FROM PUBLIC;
+
+CREATE FUNCTION pg_wait_sampling_get_queryids (
+	OUT id int4,
+	OUT queryid int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
@@ -9,9 +9,13 @@
  */
 #include "postgres.h"
 
+#include <ctype.h>
+
 #include "access/htup_details.h"
+#include "access/parallel.h"
 #include "access/twophase.h"
 #include "catalog/pg_type.h"
+#include "executor/executor.h"
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
@@ -21,12 +25,14 @@
 #if PG_VERSION_NUM >= 120000
 #include "replication/walsender.h"
 #endif
+#include "storage/dsm.h"
 #include "storage/ipc.h"
+#include "storage/lwlock.h"
 #include "storage/pg_shmem.h"
 #include "storage/procarray.h"
-#include "storage/shm_mq.h"
 #include "storage/shm_toc.h"
 #include "storage/spin.h"
+#include "tcop/utility.h"
 #include "utils/builtins.h"
 #include "utils/datetime.h"
 #include "utils/guc_tables.h"
@@ -44,30 +50,106 @@ void		_PG_init(void);
 static bool shmem_initialized = false;
 
 /* Hooks */
+static ExecutorStart_hook_type	prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type	prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type	prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type	prev_ExecutorEnd = NULL;
+#if PG_VERSION_NUM >= 100000
+static ProcessUtility_hook_type	prev_ProcessUtility = NULL;
+#endif
 static planner_hook_type		planner_hook_next = NULL;
 
 /* Pointers to shared memory objects */
-shm_mq				   *pgws_collector_mq = NULL;
+ProfileTable		   *pgws_profile_table = NULL;
+WaitHistogramTable	   *pgws_histogram_table = NULL;
+ProfileSeries		   *pgws_profile_series = NULL;
+TopNTable			   *pgws_topn_table = NULL;
 uint64				   *pgws_proc_queryids = NULL;
-CollectorShmqHeader	   *pgws_collector_hdr = NULL;
+ProcPidMap			   *pgws_proc_pids = NULL;
+QueryIdDict			   *pgws_query_dict = NULL;
+CollectorSharedState   *pgws_collector_hdr = NULL;
+
+/* GUC variables not placed into shared memory */
+static int	pgws_profile_size = 10000;
+static int	pgws_histogram_size = 1000;
+static int	pgws_series_buckets = 60;
+static int	pgws_series_resolution = 60;
+static int	pgws_series_size = 500;
+static int	pgws_topn_size = 0;
+static int	pgws_queryid_dict_size = 10000;
+static int	pgws_history_shmem_size = 0;
+static int	pgws_capture_size = 0;
+static int	pgws_collectors = 1;
+bool		pgws_persist_history = false;
+int			pgws_persist_flush_period = 1000;
+int			pgws_persist_segment_size = 16384;
+int			pgws_persist_segments = 16;
+
+/*
+ * Sampling filters.  They are compiled by check hooks, and the collector
+ * sees them combined in shared memory.  They can be set only in
+ * configuration files, so that all processes agree on them, and only the
+ * postmaster puts them to shared memory.
+ */
+static char *pgws_include_waits = NULL;
+static char *pgws_exclude_waits = NULL;
+static char *pgws_exclude_backend_types = NULL;
+static char *pgws_capture_waits = NULL;
+
+typedef struct
+{
+	bool		empty;
+	WaitFilter	listed;
+} WaitList;
+
+static WaitList *include_waits_list = NULL;
+static WaitList *exclude_waits_list = NULL;
+static WaitList *capture_waits_list = NULL;
+static uint32 exclude_backend_types_mask = 0;
+
+/* Names of PGWS_BACKEND_* backend types */
+static const char *const backend_type_names[] =
+{
+	NULL,
+	"backend",
+	"autovacuum worker",
+	"background worker",
+	"auxiliary process"
+};
 
-/* Receiver (backend) local shm_mq pointers and lock */
-static shm_mq *recv_mq = NULL;
-static shm_mq_handle *recv_mqh = NULL;
-static LOCKTAG queueTag;
 
 #if PG_VERSION_NUM >= 150000
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
 #endif
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
-static PGPROC * search_proc(int backendPid);
 static PlannedStmt *pgws_planner_hook(Query *parse,
 #if PG_VERSION_NUM >= 130000
 		const char *query_string,
 #endif
 		int cursorOptions, ParamListInfo boundParams);
+static void pgws_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void pgws_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+		uint64 count
+#if PG_VERSION_NUM >= 100000
+		, bool execute_once
+#endif
+		);
+static void pgws_ExecutorFinish(QueryDesc *queryDesc);
 static void pgws_ExecutorEnd(QueryDesc *queryDesc);
+#if PG_VERSION_NUM >= 100000
+static void pgws_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+#if PG_VERSION_NUM >= 140000
+		bool readOnlyTree,
+#endif
+		ProcessUtilityContext context, ParamListInfo params,
+		QueryEnvironment *queryEnv, DestReceiver *dest,
+#if PG_VERSION_NUM >= 130000
+		QueryCompletion *qc
+#else
+		char *completionTag
+#endif
+		);
+#endif
 
 /*
  * Calculate max processes count.
@@ -129,6 +211,179 @@ get_max_procs_count(void)
 	return count;
 }
 
+/*
+ * Number of profile table slots: power of 2 leaving at least half of the
+ * table empty when it holds maxEntries entries.
+ */
+static uint32
+get_profile_nslots(int maxEntries)
+{
+	uint32		nslots = 16;
+
+	while (nslots < (uint32) maxEntries * 2)
+		nslots <<= 1;
+
+	return nslots;
+}
+
+static Size
+get_profile_table_size(int maxEntries)
+{
+	return add_size(offsetof(ProfileTable, slots),
+					mul_size(sizeof(ProfileSlot), get_profile_nslots(maxEntries)));
+}
+
+/*
+ * Initialize empty profile table for maxEntries entries.
+ */
+static void
+init_profile_table(ProfileTable *table, int maxEntries)
+{
+	MemSet(table, 0, get_profile_table_size(maxEntries));
+	table->nslots = get_profile_nslots(maxEntries);
+	table->maxEntries = maxEntries;
+	pg_atomic_init_u64(&table->generation, 0);
+	pg_atomic_init_u64(&table->resetGeneration, 0);
+}
+
+/*
+ * Size of profile series: bucket headers followed by a profile table per
+ * bucket.
+ */
+static Size
+get_series_size(void)
+{
+	Size		size;
+
+	size = MAXALIGN(add_size(offsetof(ProfileSeries, buckets),
+							 mul_size(sizeof(SeriesBucket), pgws_series_buckets)));
+	return add_size(size, mul_size(MAXALIGN(get_profile_table_size(pgws_series_size)),
+								   pgws_series_buckets));
+}
+
+/*
+ * Size of heavy hitters profile: entries, their heap and index.
+ */
+static Size
+get_topn_heap_offset(void)
+{
+	return MAXALIGN(add_size(offsetof(TopNTable, entries),
+							 mul_size(sizeof(TopNEntry), pgws_topn_size)));
+}
+
+static Size
+get_topn_index_offset(void)
+{
+	return add_size(get_topn_heap_offset(),
+					MAXALIGN(mul_size(sizeof(int32), pgws_topn_size)));
+}
+
+static Size
+get_topn_size(void)
+{
+	return add_size(get_topn_index_offset(),
+					mul_size(sizeof(int32), get_profile_nslots(pgws_topn_size)));
+}
+
+/*
+ * Number of wait histogram table slots, chosen the same way as for profile.
+ */
+static uint32
+get_histogram_nslots(void)
+{
+	uint32		nslots = 16;
+
+	while (nslots < (uint32) pgws_histogram_size * 2)
+		nslots <<= 1;
+
+	return nslots;
+}
+
+static Size
+get_histogram_table_size(void)
+{
+	return add_size(offsetof(WaitHistogramTable, slots),
+					mul_size(sizeof(WaitHistogramSlot), get_histogram_nslots()));
+}
+
+/*
+ * Size of queryId dictionary: dense array of queryIds followed by the index
+ * of their ids, of the same number of slots as profile table.
+ */
+static Size
+get_query_dict_index_offset(void)
+{
+	return MAXALIGN(add_size(offsetof(QueryIdDict, queryIds),
+							 mul_size(sizeof(uint64), pgws_queryid_dict_size)));
+}
+
+static Size
+get_query_dict_size(void)
+{
+	return add_size(get_query_dict_index_offset(),
+					mul_size(sizeof(uint32),
+							 get_profile_nslots(pgws_queryid_dict_size)));
+}
+
+static uint32
+get_pid_map_nslots(void)
+{
+	uint32		nslots = 16;
+
+	while (nslots < (uint32) get_max_procs_count() * 2)
+		nslots <<= 1;
+
+	return nslots;
+}
+
+static Size
+get_pid_map_size(void)
+{
+	return add_size(offsetof(ProcPidMap, slots),
+					mul_size(sizeof(pg_atomic_uint64), get_pid_map_nslots()));
+}
+
+static Size
+get_collector_hdr_size(void)
+{
+	return add_size(offsetof(CollectorSharedState, shards),
+					mul_size(sizeof(CollectorShard), pgws_collectors));
+}
+
+/*
+ * Capacity of every shard's waits history ring preallocated in shared
+ * memory, which is split evenly between shards.
+ */
+static Size
+get_shmem_history_capacity(void)
+{
+	return mul_size(pgws_history_shmem_size, 1024) / pgws_collectors;
+}
+
+static Size
+get_shmem_history_size(void)
+{
+	return mul_size(MAXALIGN(pgws_history_ring_size(get_shmem_history_capacity())),
+					pgws_collectors);
+}
+
+/*
+ * Capacity of every shard's capture ring, pg_wait_sampling.capture_size is
+ * split evenly between shards too.
+ */
+static Size
+get_capture_capacity(void)
+{
+	return mul_size(pgws_capture_size, 1024) / pgws_collectors;
+}
+
+static Size
+get_capture_size(void)
+{
+	return mul_size(MAXALIGN(pgws_history_ring_size(get_capture_capacity())),
+					pgws_collectors);
+}
+
 /*
  * Estimate amount of shared memory needed.
  */
@@ -141,11 +396,20 @@ pgws_shmem_size(void)
 
 	shm_toc_initialize_estimator(&e);
 
-	nkeys = 3;
+	nkeys = 10;
 
-	shm_toc_estimate_chunk(&e, sizeof(CollectorShmqHeader));
-	shm_toc_estimate_chunk(&e, (Size) COLLECTOR_QUEUE_SIZE);
+	shm_toc_estimate_chunk(&e, get_collector_hdr_size());
+	shm_toc_estimate_chunk(&e, get_profile_table_size(pgws_profile_size));
 	shm_toc_estimate_chunk(&e, sizeof(uint64) * get_max_procs_count());
+	shm_toc_estimate_chunk(&e, get_histogram_table_size());
+	shm_toc_estimate_chunk(&e, get_series_size());
+	shm_toc_estimate_chunk(&e, get_topn_size());
+	shm_toc_estimate_chunk(&e, get_pid_map_size());
+	shm_toc_estimate_chunk(&e, get_query_dict_size());
+	if (pgws_history_shmem_size > 0)
+		shm_toc_estimate_chunk(&e, get_shmem_history_size());
+	if (pgws_capture_size > 0)
+		shm_toc_estimate_chunk(&e, get_capture_size());
 
 	shm_toc_estimate_keys(&e, nkeys);
 	size = shm_toc_estimate(&e);
@@ -169,6 +433,273 @@ shmem_bool_guc_check_hook(bool *newval, void **extra, GucSource source)
 	return true;
 }
 
+static bool
+shmem_real_guc_check_hook(double *newval, void **extra, GucSource source)
+{
+	if (UsedShmemSegAddr == NULL)
+		return false;
+	return true;
+}
+
+static bool
+shmem_enum_guc_check_hook(int *newval, void **extra, GucSource source)
+{
+	if (UsedShmemSegAddr == NULL)
+		return false;
+	return true;
+}
+
+/*
+ * Split comma-separated list of names in place, trimming whitespace around
+ * them.  Names may contain inner spaces, unlike SplitIdentifierString().
+ */
+static List *
+split_name_list(char *rawstring)
+{
+	List	   *result = NIL;
+	char	   *p = rawstring;
+
+	while (*p)
+	{
+		char	   *name,
+				   *end;
+
+		while (isspace((unsigned char) *p))
+			p++;
+		name = p;
+		while (*p && *p != ',')
+			p++;
+		end = p;
+		while (end > name && isspace((unsigned char) end[-1]))
+			end--;
+		if (*p == ',')
+			p++;
+		*end = '\0';
+
+		if (*name)
+			result = lappend(result, name);
+	}
+	return result;
+}
+
+/*
+ * Mark waits named by list item, either "Type" or "Type:Event", in the
+ * bitmap.
+ */
+static bool
+parse_wait_item(char *item, WaitFilter *filter)
+{
+	char	   *event = strchr(item, ':');
+	uint32		classId,
+				eventId,
+				nevents = WAIT_FILTER_EVENTS - 1;
+	bool		found = false;
+
+	if (event)
+		*event++ = '\0';
+
+	for (classId = 1; classId < WAIT_FILTER_CLASSES; classId++)
+	{
+		const char *type = pgstat_get_wait_event_type(classId << 24);
+
+		if (type && pg_strcasecmp(type, item) == 0)
+			break;
+	}
+	if (classId == WAIT_FILTER_CLASSES)
+	{
+		GUC_check_errdetail("Unrecognized wait event type: \"%s\".", item);
+		return false;
+	}
+
+	if (event == NULL)
+	{
+		memset(filter->bits[classId], 0xFF, sizeof(filter->bits[classId]));
+		return true;
+	}
+
+#if PG_VERSION_NUM < 100000
+	/* Names of individual LWLocks are looked up without bounds check */
+	if ((classId << 24) == PG_WAIT_LWLOCK_NAMED)
+		nevents = NUM_INDIVIDUAL_LWLOCKS;
+#endif
+
+	for (eventId = 0; eventId < nevents; eventId++)
+	{
+		const char *name = pgstat_get_wait_event((classId << 24) | eventId);
+
+		if (name && pg_strcasecmp(name, event) == 0)
+		{
+			filter->bits[classId][eventId >> 3] |= 1 << (eventId & 7);
+			found = true;
+		}
+	}
+	if (!found)
+	{
+		GUC_check_errdetail("Unrecognized wait event: \"%s:%s\".", item, event);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Check hook of pg_wait_sampling.include_waits, exclude_waits and
+ * capture_waits, which compiles the list into bitmap of listed waits.
+ */
+static bool
+wait_list_check_hook(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring = pstrdup(*newval);
+	List	   *items;
+	ListCell   *lc;
+	WaitList   *list;
+
+	items = split_name_list(rawstring);
+
+	list = (WaitList *) malloc(sizeof(WaitList));
+	if (list == NULL)
+		return false;
+	MemSet(list, 0, sizeof(WaitList));
+	list->empty = (items == NIL);
+
+	foreach(lc, items)
+	{
+		if (!parse_wait_item((char *) lfirst(lc), &list->listed))
+		{
+			free(list);
+			list_free(items);
+			pfree(rawstring);
+			return false;
+		}
+	}
+
+	list_free(items);
+	pfree(rawstring);
+	*extra = list;
+	return true;
+}
+
+static bool
+backend_types_check_hook(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring = pstrdup(*newval);
+	List	   *items;
+	ListCell   *lc;
+	uint32	   *mask;
+
+	items = split_name_list(rawstring);
+
+	mask = (uint32 *) malloc(sizeof(uint32));
+	if (mask == NULL)
+		return false;
+	*mask = 0;
+
+	foreach(lc, items)
+	{
+		const char *name = (const char *) lfirst(lc);
+		int			type;
+
+		for (type = PGWS_BACKEND_REGULAR; type <= PGWS_BACKEND_AUXILIARY; type++)
+		{
+			if (pg_strcasecmp(backend_type_names[type], name) == 0)
+				break;
+		}
+		if (type > PGWS_BACKEND_AUXILIARY)
+		{
+			GUC_check_errdetail("Unrecognized backend type: \"%s\".", name);
+			free(mask);
+			list_free(items);
+			pfree(rawstring);
+			return false;
+		}
+		*mask |= 1 << type;
+	}
+
+	list_free(items);
+	pfree(rawstring);
+	*extra = mask;
+	return true;
+}
+
+/*
+ * Combine sampling filters into shared memory, along with trigger waits of
+ * capture.  Every process applies the same configuration on reload, but only
+ * the postmaster writes it there, so the collector sees a single writer.
+ * Changes of filters are seen by the collector on the next probe.
+ */
+static void
+update_sampling_filters(void)
+{
+	volatile WaitFilter *filter;
+	int			classId,
+				i;
+
+	if (pgws_collector_hdr == NULL || IsUnderPostmaster)
+		return;
+
+	filter = &pgws_collector_hdr->waitFilter;
+	for (classId = 0; classId < WAIT_FILTER_CLASSES; classId++)
+	{
+		for (i = 0; i < WAIT_FILTER_EVENTS / 8; i++)
+		{
+			uint8		excluded = 0;
+
+			if (include_waits_list && !include_waits_list->empty)
+				excluded |= ~include_waits_list->listed.bits[classId][i];
+			if (exclude_waits_list)
+				excluded |= exclude_waits_list->listed.bits[classId][i];
+			filter->bits[classId][i] = excluded;
+			pgws_collector_hdr->captureWaits.bits[classId][i] =
+				capture_waits_list ? capture_waits_list->listed.bits[classId][i] : 0;
+		}
+	}
+	pgws_collector_hdr->excludedBackendTypes = exclude_backend_types_mask;
+	pgws_collector_hdr->captureEnabled =
+		(capture_waits_list != NULL && !capture_waits_list->empty);
+}
+
+static void
+include_waits_assign_hook(const char *newval, void *extra)
+{
+	include_waits_list = (WaitList *) extra;
+	update_sampling_filters();
+}
+
+static void
+exclude_waits_assign_hook(const char *newval, void *extra)
+{
+	exclude_waits_list = (WaitList *) extra;
+	update_sampling_filters();
+}
+
+static void
+capture_waits_assign_hook(const char *newval, void *extra)
+{
+	capture_waits_list = (WaitList *) extra;
+	update_sampling_filters();
+}
+
+static void
+exclude_backend_types_assign_hook(const char *newval, void *extra)
+{
+	exclude_backend_types_mask = *(uint32 *) extra;
+	update_sampling_filters();
+}
+
+/* Wait classes which can be counted by adaptive sampling */
+static const struct config_enum_entry adaptive_wait_class_options[] = {
+	{"all", 0, false},
+	{"lwlock", PG_WAIT_LWLOCK, false},
+	{"lock", PG_WAIT_LOCK, false},
+	{"bufferpin", PG_WAIT_BUFFER_PIN, false},
+	{"activity", PG_WAIT_ACTIVITY, false},
+	{"client", PG_WAIT_CLIENT, false},
+	{"extension", PG_WAIT_EXTENSION, false},
+	{"ipc", PG_WAIT_IPC, false},
+	{"timeout", PG_WAIT_TIMEOUT, false},
+	{"io", PG_WAIT_IO, false},
+	{NULL, 0, false}
+};
+
 /*
  * This union allows us to mix the numerous different types of structs
  * that we are organizing.
@@ -196,7 +727,19 @@ setup_gucs()
 				history_period_found = false,
 				profile_period_found = false,
 				profile_pid_found = false,
-				profile_queries_found = false;
+				profile_queries_found = false,
+				lockless_sampling_found = false,
+				adaptive_sampling_found = false,
+				adaptive_threshold_found = false,
+				adaptive_wait_class_found = false,
+				lock_blockers_found = false,
+				lock_blockers_period_found = false,
+				profile_database_found = false,
+				profile_role_found = false,
+				profile_backend_type_found = false,
+				capture_threshold_found = false,
+				capture_period_found = false,
+				capture_duration_found = false;
 
 	get_guc_variables_compat(&guc_vars, &numOpts);
 
@@ -217,13 +760,13 @@ setup_gucs()
 		else if (!strcmp(name, "pg_wait_sampling.history_period"))
 		{
 			history_period_found = true;
-			var->integer.variable = &pgws_collector_hdr->historyPeriod;
+			var->real.variable = &pgws_collector_hdr->historyPeriod;
 			pgws_collector_hdr->historyPeriod = 10;
 		}
 		else if (!strcmp(name, "pg_wait_sampling.profile_period"))
 		{
 			profile_period_found = true;
-			var->integer.variable = &pgws_collector_hdr->profilePeriod;
+			var->real.variable = &pgws_collector_hdr->profilePeriod;
 			pgws_collector_hdr->profilePeriod = 10;
 		}
 		else if (!strcmp(name, "pg_wait_sampling.profile_pid"))
@@ -238,6 +781,78 @@ setup_gucs()
 			var->_bool.variable = &pgws_collector_hdr->profileQueries;
 			pgws_collector_hdr->profileQueries = true;
 		}
+		else if (!strcmp(name, "pg_wait_sampling.lockless_sampling"))
+		{
+			lockless_sampling_found = true;
+			var->_bool.variable = &pgws_collector_hdr->locklessSampling;
+			pgws_collector_hdr->locklessSampling = false;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.adaptive_sampling"))
+		{
+			adaptive_sampling_found = true;
+			var->_bool.variable = &pgws_collector_hdr->adaptiveSampling;
+			pgws_collector_hdr->adaptiveSampling = false;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.adaptive_threshold"))
+		{
+			adaptive_threshold_found = true;
+			var->integer.variable = &pgws_collector_hdr->adaptiveThreshold;
+			pgws_collector_hdr->adaptiveThreshold = 8;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.adaptive_wait_class"))
+		{
+			adaptive_wait_class_found = true;
+			var->_enum.variable = &pgws_collector_hdr->adaptiveWaitClass;
+			pgws_collector_hdr->adaptiveWaitClass = 0;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.lock_blockers"))
+		{
+			lock_blockers_found = true;
+			var->_bool.variable = &pgws_collector_hdr->lockBlockers;
+			pgws_collector_hdr->lockBlockers = false;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.lock_blockers_period"))
+		{
+			lock_blockers_period_found = true;
+			var->integer.variable = &pgws_collector_hdr->lockBlockersPeriod;
+			pgws_collector_hdr->lockBlockersPeriod = 1000;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.profile_database"))
+		{
+			profile_database_found = true;
+			var->_bool.variable = &pgws_collector_hdr->profileDatabase;
+			pgws_collector_hdr->profileDatabase = false;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.profile_role"))
+		{
+			profile_role_found = true;
+			var->_bool.variable = &pgws_collector_hdr->profileRole;
+			pgws_collector_hdr->profileRole = false;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.profile_backend_type"))
+		{
+			profile_backend_type_found = true;
+			var->_bool.variable = &pgws_collector_hdr->profileBackendType;
+			pgws_collector_hdr->profileBackendType = false;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.capture_threshold"))
+		{
+			capture_threshold_found = true;
+			var->integer.variable = &pgws_collector_hdr->captureThreshold;
+			pgws_collector_hdr->captureThreshold = 10;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.capture_period"))
+		{
+			capture_period_found = true;
+			var->real.variable = &pgws_collector_hdr->capturePeriod;
+			pgws_collector_hdr->capturePeriod = 1;
+		}
+		else if (!strcmp(name, "pg_wait_sampling.capture_duration"))
+		{
+			capture_duration_found = true;
+			var->integer.variable = &pgws_collector_hdr->captureDuration;
+			pgws_collector_hdr->captureDuration = 1000;
+		}
 	}
 
 	if (!history_size_found)
@@ -247,16 +862,16 @@ setup_gucs()
 				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
 
 	if (!history_period_found)
-		DefineCustomIntVariable("pg_wait_sampling.history_period",
-				"Sets period of waits history sampling.", NULL,
-				&pgws_collector_hdr->historyPeriod, 10, 1, INT_MAX,
-				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
+		DefineCustomRealVariable("pg_wait_sampling.history_period",
+				"Sets period of waits history sampling in milliseconds.", NULL,
+				&pgws_collector_hdr->historyPeriod, 10, 0.1, INT_MAX,
+				PGC_SUSET, 0, shmem_real_guc_check_hook, NULL, NULL);
 
 	if (!profile_period_found)
-		DefineCustomIntVariable("pg_wait_sampling.profile_period",
-				"Sets period of waits profile sampling.", NULL,
-				&pgws_collector_hdr->profilePeriod, 10, 1, INT_MAX,
-				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
+		DefineCustomRealVariable("pg_wait_sampling.profile_period",
+				"Sets period of waits profile sampling in milliseconds.", NULL,
+				&pgws_collector_hdr->profilePeriod, 10, 0.1, INT_MAX,
+				PGC_SUSET, 0, shmem_real_guc_check_hook, NULL, NULL);
 
 	if (!profile_pid_found)
 		DefineCustomBoolVariable("pg_wait_sampling.profile_pid",
@@ -270,11 +885,95 @@ setup_gucs()
 				&pgws_collector_hdr->profileQueries, true,
 				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
 
-	if (history_size_found
+	if (!lockless_sampling_found)
+		DefineCustomBoolVariable("pg_wait_sampling.lockless_sampling",
+				"Sets whether waits should be sampled without taking ProcArrayLock.", NULL,
+				&pgws_collector_hdr->locklessSampling, false,
+				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
+
+	if (!adaptive_sampling_found)
+		DefineCustomBoolVariable("pg_wait_sampling.adaptive_sampling",
+				"Sets whether sampling periods should adapt to the number of waiting processes.", NULL,
+				&pgws_collector_hdr->adaptiveSampling, false,
+				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
+
+	if (!adaptive_threshold_found)
+		DefineCustomIntVariable("pg_wait_sampling.adaptive_threshold",
+				"Sets number of waiting processes which doubles sampling rate in adaptive mode.", NULL,
+				&pgws_collector_hdr->adaptiveThreshold, 8, 1, INT_MAX / 16,
+				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
+
+	if (!adaptive_wait_class_found)
+		DefineCustomEnumVariable("pg_wait_sampling.adaptive_wait_class",
+				"Sets class of waits counted by adaptive mode.", NULL,
+				&pgws_collector_hdr->adaptiveWaitClass, 0, adaptive_wait_class_options,
+				PGC_SUSET, 0, shmem_enum_guc_check_hook, NULL, NULL);
+
+	if (!lock_blockers_found)
+		DefineCustomBoolVariable("pg_wait_sampling.lock_blockers",
+				"Sets whether blockers of heavyweight lock waits should be sampled.", NULL,
+				&pgws_collector_hdr->lockBlockers, false,
+				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
+
+	if (!lock_blockers_period_found)
+		DefineCustomIntVariable("pg_wait_sampling.lock_blockers_period",
+				"Sets minimal period of lock blockers lookup in milliseconds.", NULL,
+				&pgws_collector_hdr->lockBlockersPeriod, 1000, 10, INT_MAX,
+				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
+
+	if (!profile_database_found)
+		DefineCustomBoolVariable("pg_wait_sampling.profile_database",
+				"Sets whether profile should be collected per database.", NULL,
+				&pgws_collector_hdr->profileDatabase, false,
+				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
+
+	if (!profile_role_found)
+		DefineCustomBoolVariable("pg_wait_sampling.profile_role",
+				"Sets whether profile should be collected per role.", NULL,
+				&pgws_collector_hdr->profileRole, false,
+				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
+
+	if (!profile_backend_type_found)
+		DefineCustomBoolVariable("pg_wait_sampling.profile_backend_type",
+				"Sets whether profile should be collected per backend type.", NULL,
+				&pgws_collector_hdr->profileBackendType, false,
+				PGC_SUSET, 0, shmem_bool_guc_check_hook, NULL, NULL);
+
+	if (!capture_threshold_found)
+		DefineCustomIntVariable("pg_wait_sampling.capture_threshold",
+				"Sets number of processes in trigger waits which starts capture of waits.", NULL,
+				&pgws_collector_hdr->captureThreshold, 10, 1, INT_MAX,
+				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
+
+	if (!capture_period_found)
+		DefineCustomRealVariable("pg_wait_sampling.capture_period",
+				"Sets period of waits capture sampling in milliseconds.", NULL,
+				&pgws_collector_hdr->capturePeriod, 1, 0.1, INT_MAX,
+				PGC_SUSET, 0, shmem_real_guc_check_hook, NULL, NULL);
+
+	if (!capture_duration_found)
+		DefineCustomIntVariable("pg_wait_sampling.capture_duration",
+				"Sets duration of waits capture in milliseconds.", NULL,
+				&pgws_collector_hdr->captureDuration, 1000, 1, INT_MAX,
+				PGC_SUSET, 0, shmem_int_guc_check_hook, NULL, NULL);
+
+	if (history_size_found
 		|| history_period_found
 		|| profile_period_found
 		|| profile_pid_found
-		|| profile_queries_found)
+		|| profile_queries_found
+		|| lockless_sampling_found
+		|| adaptive_sampling_found
+		|| adaptive_threshold_found
+		|| adaptive_wait_class_found
+		|| lock_blockers_found
+		|| lock_blockers_period_found
+		|| profile_database_found
+		|| profile_role_found
+		|| profile_backend_type_found
+		|| capture_threshold_found
+		|| capture_period_found
+		|| capture_duration_found)
 	{
 		ProcessConfigFile(PGC_SIGHUP);
 	}
@@ -294,6 +993,7 @@ pgws_shmem_request(void)
 		prev_shmem_request_hook();
 
 	RequestAddinShmemSpace(pgws_shmem_size());
+	RequestNamedLWLockTranche("pg_wait_sampling", 1);
 }
 #endif
 
@@ -307,6 +1007,7 @@ pgws_shmem_startup(void)
 	Size		segsize = pgws_shmem_size();
 	void	   *pgws;
 	shm_toc	   *toc;
+	int			i;
 
 	pgws = ShmemInitStruct("pg_wait_sampling", segsize, &found);
 
@@ -314,17 +1015,109 @@ pgws_shmem_startup(void)
 	{
 		toc = shm_toc_create(PG_WAIT_SAMPLING_MAGIC, pgws, segsize);
 
-		pgws_collector_hdr = shm_toc_allocate(toc, sizeof(CollectorShmqHeader));
+		pgws_collector_hdr = shm_toc_allocate(toc, get_collector_hdr_size());
 		shm_toc_insert(toc, 0, pgws_collector_hdr);
-		pgws_collector_mq = shm_toc_allocate(toc, COLLECTOR_QUEUE_SIZE);
-		shm_toc_insert(toc, 1, pgws_collector_mq);
+		pgws_collector_hdr->aggregateLock =
+			&(GetNamedLWLockTranche("pg_wait_sampling"))->lock;
+		pgws_collector_hdr->nshards = pgws_collectors;
+		MemSet(pgws_collector_hdr->shards, 0,
+			   sizeof(CollectorShard) * pgws_collectors);
+		for (i = 0; i < pgws_collectors; i++)
+			pgws_collector_hdr->shards[i].historyHandle = DSM_HANDLE_INVALID;
+		pg_atomic_init_u64(&pgws_collector_hdr->reads, 0);
+		pg_atomic_init_u64(&pgws_collector_hdr->readRetries, 0);
+		pgws_profile_table = shm_toc_allocate(toc,
+									get_profile_table_size(pgws_profile_size));
+		shm_toc_insert(toc, 1, pgws_profile_table);
+		init_profile_table(pgws_profile_table, pgws_profile_size);
 		pgws_proc_queryids = shm_toc_allocate(toc,
 									sizeof(uint64) * get_max_procs_count());
 		shm_toc_insert(toc, 2, pgws_proc_queryids);
 		MemSet(pgws_proc_queryids, 0, sizeof(uint64) * get_max_procs_count());
+		pgws_histogram_table = shm_toc_allocate(toc, get_histogram_table_size());
+		shm_toc_insert(toc, 3, pgws_histogram_table);
+		MemSet(pgws_histogram_table, 0, get_histogram_table_size());
+		pgws_histogram_table->nslots = get_histogram_nslots();
+		pgws_histogram_table->maxEntries = pgws_histogram_size;
+		pgws_profile_series = shm_toc_allocate(toc, get_series_size());
+		shm_toc_insert(toc, 4, pgws_profile_series);
+		MemSet(pgws_profile_series, 0, offsetof(ProfileSeries, buckets));
+		pgws_profile_series->nbuckets = pgws_series_buckets;
+		pgws_profile_series->resolution = (int64) pgws_series_resolution * USECS_PER_SEC;
+		pgws_profile_series->tableSize = MAXALIGN(get_profile_table_size(pgws_series_size));
+		pgws_profile_series->tablesOffset =
+			MAXALIGN(offsetof(ProfileSeries, buckets) +
+					 sizeof(SeriesBucket) * pgws_series_buckets);
+		for (i = 0; i < pgws_series_buckets; i++)
+		{
+			pgws_profile_series->buckets[i].changecount = 0;
+			pgws_profile_series->buckets[i].start_ts = 0;
+			init_profile_table(pgws_series_table(pgws_profile_series, i),
+							   pgws_series_size);
+		}
+		pgws_topn_table = shm_toc_allocate(toc, get_topn_size());
+		shm_toc_insert(toc, 5, pgws_topn_table);
+		pgws_topn_table->changecount = 0;
+		pgws_topn_table->maxEntries = pgws_topn_size;
+		pgws_topn_table->nentries = 0;
+		pgws_topn_table->nslots = get_profile_nslots(pgws_topn_size);
+		pgws_topn_table->heapOffset = get_topn_heap_offset();
+		pgws_topn_table->indexOffset = get_topn_index_offset();
+		memset(pgws_topn_table->entries, 0, sizeof(TopNEntry) * pgws_topn_size);
+		memset(pgws_topn_index(pgws_topn_table), 0xFF,
+			   sizeof(int32) * pgws_topn_table->nslots);
+		pgws_proc_pids = shm_toc_allocate(toc, get_pid_map_size());
+		shm_toc_insert(toc, 7, pgws_proc_pids);
+		pgws_proc_pids->nslots = get_pid_map_nslots();
+		for (i = 0; i < pgws_proc_pids->nslots; i++)
+			pg_atomic_init_u64(&pgws_proc_pids->slots[i], 0);
+		pgws_query_dict = shm_toc_allocate(toc, get_query_dict_size());
+		shm_toc_insert(toc, 9, pgws_query_dict);
+		MemSet(pgws_query_dict, 0, get_query_dict_size());
+		pgws_query_dict->maxEntries = pgws_queryid_dict_size;
+		pgws_query_dict->nslots = get_profile_nslots(pgws_queryid_dict_size);
+		pgws_query_dict->indexOffset = get_query_dict_index_offset();
+		pg_atomic_init_u32(&pgws_query_dict->nentries, 0);
+		pg_atomic_init_u32(&pgws_query_dict->generation, 0);
+		if (pgws_history_shmem_size > 0)
+		{
+			char	   *rings = shm_toc_allocate(toc, get_shmem_history_size());
+			Size		capacity = get_shmem_history_capacity();
+
+			shm_toc_insert(toc, 6, rings);
+			for (i = 0; i < pgws_collectors; i++)
+			{
+				HistoryRing *ring = (HistoryRing *)
+					(rings + i * MAXALIGN(pgws_history_ring_size(capacity)));
+
+				pgws_history_init(ring, capacity);
+				pgws_collector_hdr->shards[i].shmemHistory = ring;
+			}
+		}
+		pgws_collector_hdr->captureState = CAPTURE_ARMED;
+		pgws_collector_hdr->captureStart = 0;
+		pgws_collector_hdr->captureEnd = 0;
+		pgws_collector_hdr->captureEvent = 0;
+		pgws_collector_hdr->captureWaiting = 0;
+		if (pgws_capture_size > 0)
+		{
+			char	   *rings = shm_toc_allocate(toc, get_capture_size());
+			Size		capacity = get_capture_capacity();
+
+			shm_toc_insert(toc, 8, rings);
+			for (i = 0; i < pgws_collectors; i++)
+			{
+				HistoryRing *ring = (HistoryRing *)
+					(rings + i * MAXALIGN(pgws_history_ring_size(capacity)));
+
+				pgws_history_init(ring, capacity);
+				pgws_collector_hdr->shards[i].captureRing = ring;
+			}
+		}
 
 		/* Initialize GUC variables in shared memory */
 		setup_gucs();
+		update_sampling_filters();
 	}
 	else
 	{
@@ -332,12 +1125,22 @@ pgws_shmem_startup(void)
 
 #if PG_VERSION_NUM >= 100000
 		pgws_collector_hdr = shm_toc_lookup(toc, 0, false);
-		pgws_collector_mq = shm_toc_lookup(toc, 1, false);
+		pgws_profile_table = shm_toc_lookup(toc, 1, false);
 		pgws_proc_queryids = shm_toc_lookup(toc, 2, false);
+		pgws_histogram_table = shm_toc_lookup(toc, 3, false);
+		pgws_profile_series = shm_toc_lookup(toc, 4, false);
+		pgws_topn_table = shm_toc_lookup(toc, 5, false);
+		pgws_proc_pids = shm_toc_lookup(toc, 7, false);
+		pgws_query_dict = shm_toc_lookup(toc, 9, false);
 #else
 		pgws_collector_hdr = shm_toc_lookup(toc, 0);
-		pgws_collector_mq = shm_toc_lookup(toc, 1);
+		pgws_profile_table = shm_toc_lookup(toc, 1);
 		pgws_proc_queryids = shm_toc_lookup(toc, 2);
+		pgws_histogram_table = shm_toc_lookup(toc, 3);
+		pgws_profile_series = shm_toc_lookup(toc, 4);
+		pgws_topn_table = shm_toc_lookup(toc, 5);
+		pgws_proc_pids = shm_toc_lookup(toc, 7);
+		pgws_query_dict = shm_toc_lookup(toc, 9);
 #endif
 	}
 
@@ -360,23 +1163,111 @@ check_shmem(void)
 	}
 }
 
-static void
-pgws_cleanup_callback(int code, Datum arg)
-{
-	elog(DEBUG3, "pg_wait_sampling cleanup: detaching shm_mq and releasing queue lock");
-	shm_mq_detach_compat(recv_mqh, recv_mq);
-	LockRelease(&queueTag, ExclusiveLock, false);
-}
-
 /*
  * Module load callback
  */
 void
 _PG_init(void)
 {
+	int			i;
+
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
+	DefineCustomIntVariable("pg_wait_sampling.profile_size",
+			"Sets maximum number of entries in waits profile.", NULL,
+			&pgws_profile_size, 10000, 100, INT_MAX / 4,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.histogram_size",
+			"Sets maximum number of wait duration histograms.", NULL,
+			&pgws_histogram_size, 1000, 100, INT_MAX / 4,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.series_buckets",
+			"Sets number of time buckets of waits profile series.", NULL,
+			&pgws_series_buckets, 60, 0, 100000,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.series_resolution",
+			"Sets duration of time bucket of waits profile series.", NULL,
+			&pgws_series_resolution, 60, 1, 86400,
+			PGC_POSTMASTER, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.series_size",
+			"Sets maximum number of entries in time bucket of waits profile series.", NULL,
+			&pgws_series_size, 500, 100, INT_MAX / 4,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.topn_size",
+			"Sets number of heavy hitters tracked in fixed memory, 0 disables tracking.", NULL,
+			&pgws_topn_size, 0, 0, INT_MAX / 4,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.queryid_dict_size",
+			"Sets maximum number of distinct queryIds in waits profile.", NULL,
+			&pgws_queryid_dict_size, 10000, 100, INT_MAX / 4,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pg_wait_sampling.include_waits",
+			"Sets list of wait event types and Type:Event waits to sample, empty for all.", NULL,
+			&pgws_include_waits, "",
+			PGC_SIGHUP, GUC_LIST_INPUT, wait_list_check_hook,
+			include_waits_assign_hook, NULL);
+
+	DefineCustomStringVariable("pg_wait_sampling.exclude_waits",
+			"Sets list of wait event types and Type:Event waits not to sample.", NULL,
+			&pgws_exclude_waits, "",
+			PGC_SIGHUP, GUC_LIST_INPUT, wait_list_check_hook,
+			exclude_waits_assign_hook, NULL);
+
+	DefineCustomStringVariable("pg_wait_sampling.exclude_backend_types",
+			"Sets list of backend types not to sample.", NULL,
+			&pgws_exclude_backend_types, "",
+			PGC_SIGHUP, GUC_LIST_INPUT, backend_types_check_hook,
+			exclude_backend_types_assign_hook, NULL);
+
+	DefineCustomStringVariable("pg_wait_sampling.capture_waits",
+			"Sets list of wait event types and Type:Event waits which trigger capture of waits, empty disables it.", NULL,
+			&pgws_capture_waits, "",
+			PGC_SIGHUP, GUC_LIST_INPUT, wait_list_check_hook,
+			capture_waits_assign_hook, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.capture_size",
+			"Sets size of rings of waits capture in shared memory, 0 disables capture.", NULL,
+			&pgws_capture_size, 0, 0, INT_MAX / 1024,
+			PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.collectors",
+			"Sets number of collector workers sampling their shares of processes.", NULL,
+			&pgws_collectors, 1, 1, 64,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.history_shmem_size",
+			"Sets size of waits history ring preallocated in shared memory, 0 keeps it in dynamic shared memory.", NULL,
+			&pgws_history_shmem_size, 0, 0, INT_MAX / 1024,
+			PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_wait_sampling.persist_history",
+			"Sets whether waits history should be saved to disk.", NULL,
+			&pgws_persist_history, false,
+			PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.persist_flush_period",
+			"Sets period of saving waits history to disk.", NULL,
+			&pgws_persist_flush_period, 1000, 10, INT_MAX,
+			PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.persist_segment_size",
+			"Sets size of waits history segment files.", NULL,
+			&pgws_persist_segment_size, 16384, 64, INT_MAX / 1024,
+			PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_wait_sampling.persist_segments",
+			"Sets number of waits history segment files to keep per collector.", NULL,
+			&pgws_persist_segments, 16, 1, INT_MAX,
+			PGC_SIGHUP, 0, NULL, NULL, NULL);
+
 #if PG_VERSION_NUM < 150000
 	/*
 	 * Request additional shared resources.  (These are no-ops if we're not in
@@ -387,9 +1278,13 @@ _PG_init(void)
 	 * in pgsp_shmem_request() for pg15 and later.
 	 */
 	RequestAddinShmemSpace(pgws_shmem_size());
+	RequestNamedLWLockTranche("pg_wait_sampling", 1);
 #endif
 
-	pgws_register_wait_collector();
+	for (i = 0; i < pgws_collectors; i++)
+		pgws_register_wait_collector(i);
+	if (pgws_persist_history)
+		pgws_register_flusher();
 
 	/*
 	 * Install hooks.
@@ -402,521 +1297,1839 @@ _PG_init(void)
 	shmem_startup_hook		= pgws_shmem_startup;
 	planner_hook_next		= planner_hook;
 	planner_hook			= pgws_planner_hook;
+	prev_ExecutorStart		= ExecutorStart_hook;
+	ExecutorStart_hook		= pgws_ExecutorStart;
+	prev_ExecutorRun		= ExecutorRun_hook;
+	ExecutorRun_hook		= pgws_ExecutorRun;
+	prev_ExecutorFinish		= ExecutorFinish_hook;
+	ExecutorFinish_hook		= pgws_ExecutorFinish;
 	prev_ExecutorEnd		= ExecutorEnd_hook;
 	ExecutorEnd_hook		= pgws_ExecutorEnd;
+#if PG_VERSION_NUM >= 100000
+	prev_ProcessUtility		= ProcessUtility_hook;
+	ProcessUtility_hook		= pgws_ProcessUtility;
+#endif
 }
 
 /*
- * Find PGPROC entry responsible for given pid assuming ProcArrayLock was
- * already taken.
+ * Find number of PGPROC of the process with given pid, or -1 if there is no
+ * such process.  The pid map is looked up first, and all PGPROCs are
+ * scanned only if it's stale.  ProcArrayLock isn't taken, so the PGPROC may
+ * be reused by another process right after it's found.
  */
-static PGPROC *
-search_proc(int pid)
+static int
+find_procno(int pid)
 {
-	int i;
+	uint32		mask = pgws_proc_pids->nslots - 1,
+				slot;
+	int			i;
 
 	if (pid == 0)
-		return MyProc;
+		return (int) (MyProc - ProcGlobal->allProcs);
+
+	for (slot = pgws_pid_hash(pid) & mask;; slot = (slot + 1) & mask)
+	{
+		uint64		value = pg_atomic_read_u64(&pgws_proc_pids->slots[slot]);
+		int			procno = (int) (value & 0xFFFFFFFF);
+
+		if (value == 0)
+			break;
+		if ((int) (value >> 32) == pid &&
+			procno < ProcGlobal->allProcCount &&
+			((volatile PGPROC *) &ProcGlobal->allProcs[procno])->pid == pid)
+			return procno;
+	}
 
+	/* The process may have started after the map was built */
 	for (i = 0; i < ProcGlobal->allProcCount; i++)
 	{
-		PGPROC	*proc = &ProcGlobal->allProcs[i];
-		if (proc->pid && proc->pid == pid)
-		{
-			return proc;
-		}
+		if (((volatile PGPROC *) &ProcGlobal->allProcs[i])->pid == pid)
+			return i;
 	}
 
-	ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-					errmsg("backend with pid=%d not found", pid)));
-	return NULL;
+	return -1;
 }
 
-typedef struct
+/*
+ * Read current wait of the process with given pid from its PGPROC without
+ * ProcArrayLock.  Returns false if the process exited meanwhile.
+ */
+static bool
+read_current(int procno, int pid, HistoryItem *item)
 {
-	HistoryItem	   *items;
-	TimestampTz		ts;
-} WaitCurrentContext;
+	volatile PGPROC *proc = &ProcGlobal->allProcs[procno];
 
-PG_FUNCTION_INFO_V1(pg_wait_sampling_get_current);
-Datum
-pg_wait_sampling_get_current(PG_FUNCTION_ARGS)
-{
-	FuncCallContext 	*funcctx;
-	WaitCurrentContext 	*params;
+	item->pid = pid;
+	item->wait_event_info = proc->wait_event_info;
+	item->queryId = pgws_proc_queryids[procno];
 
-	check_shmem();
+	pg_read_barrier();
+	return proc->pid == pid;
+}
 
-	if (SRF_IS_FIRSTCALL())
-	{
-		MemoryContext		oldcontext;
-		TupleDesc			tupdesc;
+/*
+ * Cache of text datums with wait event type and name.  Set of wait events is
+ * small and doesn't change while backend runs, so texts are built once per
+ * backend instead of once per output row.
+ */
+#define WAIT_EVENT_TEXT_CACHE_SIZE	1024
 
-		funcctx = SRF_FIRSTCALL_INIT();
+typedef struct
+{
+	uint32			wait_event_info;
+	bool			used;
+	bool			typeIsNull;
+	bool			eventIsNull;
+	Datum			type;
+	Datum			event;
+} WaitEventText;
 
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-		params = (WaitCurrentContext *)palloc0(sizeof(WaitCurrentContext));
-		params->ts = GetCurrentTimestamp();
+static WaitEventText *wait_event_texts = NULL;
 
-		funcctx->user_fctx = params;
-		tupdesc = CreateTemplateTupleDescCompat(4, false);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pid",
-						   INT4OID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "type",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "event",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "queryid",
-						   INT8OID, -1, 0);
+static void
+build_wait_event_text(uint32 wait_event_info, Datum *values, bool *nulls)
+{
+	const char *event_type = pgstat_get_wait_event_type(wait_event_info),
+			   *event = pgstat_get_wait_event(wait_event_info);
 
-		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+	if (event_type)
+		values[0] = PointerGetDatum(cstring_to_text(event_type));
+	else
+		nulls[0] = true;
+	if (event)
+		values[1] = PointerGetDatum(cstring_to_text(event));
+	else
+		nulls[1] = true;
+}
 
-		LWLockAcquire(ProcArrayLock, LW_SHARED);
+/*
+ * Fill values[0..1] and nulls[0..1] with type and name of given wait event.
+ * Returned datums are shared between calls and must not be modified.
+ */
+static void
+get_wait_event_text(uint32 wait_event_info, Datum *values, bool *nulls)
+{
+	uint32			i,
+					n;
+	WaitEventText  *entry;
 
-		if (!PG_ARGISNULL(0))
-		{
-			HistoryItem	   *item;
-			PGPROC		   *proc;
+	if (!wait_event_texts)
+		wait_event_texts = (WaitEventText *)
+			MemoryContextAllocZero(TopMemoryContext,
+								   sizeof(WaitEventText) * WAIT_EVENT_TEXT_CACHE_SIZE);
 
-			proc = search_proc(PG_GETARG_UINT32(0));
-			params->items = (HistoryItem *) palloc0(sizeof(HistoryItem));
-			item = &params->items[0];
-			item->pid = proc->pid;
-			item->wait_event_info = proc->wait_event_info;
-			item->queryId = pgws_proc_queryids[proc - ProcGlobal->allProcs];
-			funcctx->max_calls = 1;
-		}
-		else
+	i = (wait_event_info ^ (wait_event_info >> 16)) % WAIT_EVENT_TEXT_CACHE_SIZE;
+	for (n = 0; n < WAIT_EVENT_TEXT_CACHE_SIZE; n++)
+	{
+		entry = &wait_event_texts[i];
+		if (!entry->used)
+			break;
+		if (entry->wait_event_info == wait_event_info)
 		{
-			int		procCount = ProcGlobal->allProcCount,
-					i,
-					j = 0;
-
-			params->items = (HistoryItem *) palloc0(sizeof(HistoryItem) * procCount);
-			for (i = 0; i < procCount; i++)
-			{
-				PGPROC *proc = &ProcGlobal->allProcs[i];
-
-				if (proc != NULL && proc->pid != 0 && proc->wait_event_info)
-				{
-					params->items[j].pid = proc->pid;
-					params->items[j].wait_event_info = proc->wait_event_info;
-					params->items[j].queryId = pgws_proc_queryids[i];
-					j++;
-				}
-			}
-			funcctx->max_calls = j;
+			values[0] = entry->type;
+			nulls[0] = entry->typeIsNull;
+			values[1] = entry->event;
+			nulls[1] = entry->eventIsNull;
+			return;
 		}
-
-		LWLockRelease(ProcArrayLock);
-
-		MemoryContextSwitchTo(oldcontext);
+		i = (i + 1) % WAIT_EVENT_TEXT_CACHE_SIZE;
 	}
 
-	/* stuff done on every call of the function */
-	funcctx = SRF_PERCALL_SETUP();
-	params = (WaitCurrentContext *) funcctx->user_fctx;
+	if (n >= WAIT_EVENT_TEXT_CACHE_SIZE)
+	{
+		/* Cache is full: shouldn't happen, but don't fail either */
+		build_wait_event_text(wait_event_info, values, nulls);
+		return;
+	}
 
-	if (funcctx->call_cntr < funcctx->max_calls)
+	/* Build new entry in long-lived memory */
 	{
-		HeapTuple	tuple;
-		Datum		values[4];
-		bool		nulls[4];
-		const char *event_type,
-				   *event;
-		HistoryItem *item;
+		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		Datum			v[2] = {0, 0};
+		bool			isnull[2] = {false, false};
 
-		item = &params->items[funcctx->call_cntr];
+		build_wait_event_text(wait_event_info, v, isnull);
+		MemoryContextSwitchTo(oldcontext);
 
-		/* Make and return next tuple to caller */
-		MemSet(values, 0, sizeof(values));
-		MemSet(nulls, 0, sizeof(nulls));
+		entry->wait_event_info = wait_event_info;
+		entry->type = v[0];
+		entry->typeIsNull = isnull[0];
+		entry->event = v[1];
+		entry->eventIsNull = isnull[1];
+		entry->used = true;
+	}
 
-		event_type = pgstat_get_wait_event_type(item->wait_event_info);
-		event = pgstat_get_wait_event(item->wait_event_info);
-		values[0] = Int32GetDatum(item->pid);
-		if (event_type)
-			values[1] = PointerGetDatum(cstring_to_text(event_type));
-		else
-			nulls[1] = true;
-		if (event)
-			values[2] = PointerGetDatum(cstring_to_text(event));
-		else
-			nulls[2] = true;
+	values[0] = entry->type;
+	nulls[0] = entry->typeIsNull;
+	values[1] = entry->event;
+	nulls[1] = entry->eventIsNull;
+}
 
-		values[3] = UInt64GetDatum(item->queryId);
-		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+/* Text datums of backend_type_names, also built once per backend */
+static Datum backend_type_texts[lengthof(backend_type_names)];
 
-		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
-	}
-	else
+/*
+ * Text datum with name of given known backend type.  Returned datum is shared
+ * between calls and must not be modified.
+ */
+static Datum
+get_backend_type_text(uint8 backend_type)
+{
+	Assert(backend_type > PGWS_BACKEND_UNKNOWN &&
+		   backend_type < lengthof(backend_type_names));
+
+	if (backend_type_texts[backend_type] == (Datum) 0)
 	{
-		SRF_RETURN_DONE(funcctx);
+		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		backend_type_texts[backend_type] =
+			PointerGetDatum(cstring_to_text(backend_type_names[backend_type]));
+		MemoryContextSwitchTo(oldcontext);
 	}
+	return backend_type_texts[backend_type];
 }
 
-typedef struct
+/*
+ * Put current wait of the process into tuplestore of
+ * pg_wait_sampling_get_current().
+ */
+static void
+put_current(ReturnSetInfo *rsinfo, const HistoryItem *item)
 {
-	Size			count;
-	ProfileItem	   *items;
-} Profile;
+	Datum		values[4];
+	bool		nulls[4];
 
-void
-pgws_init_lock_tag(LOCKTAG *tag, uint32 lock)
-{
-	tag->locktag_field1 = PG_WAIT_SAMPLING_MAGIC;
-	tag->locktag_field2 = lock;
-	tag->locktag_field3 = 0;
-	tag->locktag_field4 = 0;
-	tag->locktag_type = LOCKTAG_USERLOCK;
-	tag->locktag_lockmethodid = USER_LOCKMETHOD;
+	MemSet(values, 0, sizeof(values));
+	MemSet(nulls, 0, sizeof(nulls));
+
+	values[0] = Int32GetDatum(item->pid);
+	get_wait_event_text(item->wait_event_info, &values[1], &nulls[1]);
+	values[3] = UInt64GetDatum(item->queryId);
+
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
 }
 
-static void *
-receive_array(SHMRequest request, Size item_size, Size *count)
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_current);
+Datum
+pg_wait_sampling_get_current(PG_FUNCTION_ARGS)
 {
-	LOCKTAG			collectorTag;
-	shm_mq_result	res;
-	Size			len,
-					i;
-	void		   *data;
-	Pointer			result,
-					ptr;
-	MemoryContext	oldctx;
-
-	/* Ensure nobody else trying to send request to queue */
-	pgws_init_lock_tag(&queueTag, PGWS_QUEUE_LOCK);
-	LockAcquire(&queueTag, ExclusiveLock, false, false);
-
-	pgws_init_lock_tag(&collectorTag, PGWS_COLLECTOR_LOCK);
-	LockAcquire(&collectorTag, ExclusiveLock, false, false);
-	recv_mq = shm_mq_create(pgws_collector_mq, COLLECTOR_QUEUE_SIZE);
-	pgws_collector_hdr->request = request;
-	LockRelease(&collectorTag, ExclusiveLock, false);
-
-	if (!pgws_collector_hdr->latch)
-		ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-						errmsg("pg_wait_sampling collector wasn't started")));
-
-	SetLatch(pgws_collector_hdr->latch);
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HistoryItem		item;
+	int				i;
 
-	shm_mq_set_receiver(recv_mq, MyProc);
+	check_shmem();
 
-	/*
-	 * We switch to TopMemoryContext, so that recv_mqh is allocated there
-	 * and is guaranteed to survive until before_shmem_exit callbacks are
-	 * fired.  Anyway, shm_mq_detach() will free handler on its own.
-	 *
-	 * NB: we do not pass `seg` to shm_mq_attach(), so it won't set its own
-	 * callback, i.e. we do not interfere here with shm_mq_detach_callback().
-	 */
-	oldctx = MemoryContextSwitchTo(TopMemoryContext);
-	recv_mqh = shm_mq_attach(recv_mq, NULL, NULL);
-	MemoryContextSwitchTo(oldctx);
+	InitMaterializedSRFCompat(fcinfo);
 
 	/*
-	 * Now we surely attached to the shm_mq and got collector's attention.
-	 * If anything went wrong (e.g. Ctrl+C received from the client) we have
-	 * to cleanup some things, i.e. detach from the shm_mq, so collector was
-	 * able to continue responding to other requests.
-	 *
-	 * PG_ENSURE_ERROR_CLEANUP() guaranties that cleanup callback will be
-	 * fired for both ERROR and FATAL.
+	 * PGPROCs are read without ProcArrayLock, checking that the process
+	 * didn't exit while being read, as the collector does.
 	 */
-	PG_ENSURE_ERROR_CLEANUP(pgws_cleanup_callback, 0);
+	if (!PG_ARGISNULL(0))
 	{
-		res = shm_mq_receive(recv_mqh, &len, &data, false);
-		if (res != SHM_MQ_SUCCESS || len != sizeof(*count))
-			elog(ERROR, "error reading mq");
-
-		memcpy(count, data, sizeof(*count));
-
-		result = palloc(item_size * (*count));
-		ptr = result;
-
-		for (i = 0; i < *count; i++)
+		int			pid = PG_GETARG_INT32(0);
+		int			procno = find_procno(pid);
+
+		if (pid == 0)
+			pid = MyProcPid;
+		if (procno < 0 || !read_current(procno, pid, &item))
+			ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+							errmsg("backend with pid=%d not found", pid)));
+		put_current(rsinfo, &item);
+	}
+	else
+	{
+		for (i = 0; i < ProcGlobal->allProcCount; i++)
 		{
-			res = shm_mq_receive(recv_mqh, &len, &data, false);
-			if (res != SHM_MQ_SUCCESS || len != item_size)
-				elog(ERROR, "error reading mq");
+			volatile PGPROC *proc = &ProcGlobal->allProcs[i];
+			int			pid = proc->pid;
 
-			memcpy(ptr, data, item_size);
-			ptr += item_size;
+			if (pid == 0 || proc->wait_event_info == 0)
+				continue;
+			if (read_current(i, pid, &item) && item.wait_event_info != 0)
+				put_current(rsinfo, &item);
 		}
 	}
-	PG_END_ENSURE_ERROR_CLEANUP(pgws_cleanup_callback, 0);
-
-	/* We still have to detach and release lock during normal operation. */
-	shm_mq_detach_compat(recv_mqh, recv_mq);
-	LockRelease(&queueTag, ExclusiveLock, false);
 
-	return result;
+	return (Datum) 0;
 }
 
-
-PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile);
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_current_pids);
 Datum
-pg_wait_sampling_get_profile(PG_FUNCTION_ARGS)
+pg_wait_sampling_get_current_pids(PG_FUNCTION_ARGS)
 {
-	Profile			   *profile;
-	FuncCallContext	   *funcctx;
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ArrayType	   *pids = PG_GETARG_ARRAYTYPE_P(0);
+	Datum		   *elems;
+	bool		   *elemNulls;
+	int				nelems,
+					i;
 
 	check_shmem();
 
-	if (SRF_IS_FIRSTCALL())
-	{
-		MemoryContext		oldcontext;
-		TupleDesc			tupdesc;
+	InitMaterializedSRFCompat(fcinfo);
 
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+	deconstruct_array(pids, INT4OID, sizeof(int32), true, 'i',
+					  &elems, &elemNulls, &nelems);
 
-		/* Receive profile from shmq */
-		profile = (Profile *) palloc0(sizeof(Profile));
-		profile->items = (ProfileItem *) receive_array(PROFILE_REQUEST,
-										sizeof(ProfileItem), &profile->count);
+	/* Processes which aren't found are skipped */
+	for (i = 0; i < nelems; i++)
+	{
+		int			pid;
+		int			procno;
+		HistoryItem	item;
 
-		funcctx->user_fctx = profile;
-		funcctx->max_calls = profile->count;
+		if (elemNulls[i])
+			continue;
+		pid = DatumGetInt32(elems[i]);
+		procno = find_procno(pid);
+		if (pid == 0)
+			pid = MyProcPid;
+		if (procno >= 0 && read_current(procno, pid, &item))
+			put_current(rsinfo, &item);
+	}
 
-		/* Make tuple descriptor */
-		tupdesc = CreateTemplateTupleDescCompat(5, false);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pid",
-						   INT4OID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "type",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "event",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "queryid",
-						   INT8OID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "count",
-						   INT8OID, -1, 0);
-		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+	return (Datum) 0;
+}
 
-		MemoryContextSwitchTo(oldcontext);
-	}
+/* Non-empty bucket of wait duration histogram */
+typedef struct
+{
+	uint32			wait_event_info;
+	uint64			queryId;
+	int				bucket;
+	uint64			count;
+} HistogramBucket;
+
+/*
+ * Account snapshot of shared data taken by this backend, which had to
+ * re-read entries changed by the collector given number of times.
+ */
+static void
+count_read(uint64 retries)
+{
+	pg_atomic_fetch_add_u64(&pgws_collector_hdr->reads, 1);
+	if (retries > 0)
+		pg_atomic_fetch_add_u64(&pgws_collector_hdr->readRetries, (int64) retries);
+}
 
-	/* stuff done on every call of the function */
-	funcctx = SRF_PERCALL_SETUP();
+/*
+ * Copy consistent snapshot of waits profile entries updated after given
+ * generation.
+ */
+static ProfileItem *
+read_profile(ProfileTable *profile, uint64 since, Size *count)
+{
+	volatile ProfileTable *table = profile;
+	ProfileItem *result;
+	Size		n = 0,
+				allocated;
+	uint32		i;
+	uint64		retries = 0;
 
-	profile = (Profile *) funcctx->user_fctx;
+	allocated = Max(table->nentries, 64);
+	result = (ProfileItem *) palloc(sizeof(ProfileItem) * allocated);
 
-	if (funcctx->call_cntr < funcctx->max_calls)
+	for (i = 0; i < table->nslots; i++)
 	{
-		/* for each row */
-		Datum		values[5];
-		bool		nulls[5];
-		HeapTuple	tuple;
-		ProfileItem *item;
-		const char *event_type,
-				   *event;
-
-		item = &profile->items[funcctx->call_cntr];
+		volatile ProfileSlot *slot = &table->slots[i];
+		uint32		before,
+					after;
+		bool		used;
 
-		MemSet(values, 0, sizeof(values));
-		MemSet(nulls, 0, sizeof(nulls));
+		/* Retry until we read the slot while the collector doesn't change it */
+		for (;;)
+		{
+			before = slot->changecount;
+			pg_read_barrier();
+			used = slot->used;
+			if (used)
+			{
+				if (n >= allocated)
+				{
+					allocated *= 2;
+					result = (ProfileItem *) repalloc(result,
+											sizeof(ProfileItem) * allocated);
+				}
+				result[n] = slot->item;
+			}
+			pg_read_barrier();
+			after = slot->changecount;
 
-		/* Make and return next tuple to caller */
-		event_type = pgstat_get_wait_event_type(item->wait_event_info);
-		event = pgstat_get_wait_event(item->wait_event_info);
-		values[0] = Int32GetDatum(item->pid);
-		if (event_type)
-			values[1] = PointerGetDatum(cstring_to_text(event_type));
-		else
-			nulls[1] = true;
-		if (event)
-			values[2] = PointerGetDatum(cstring_to_text(event));
-		else
-			nulls[2] = true;
+			if (before == after && (before & 1) == 0)
+				break;
+			retries++;
+		}
 
-		if (pgws_collector_hdr->profileQueries)
-			values[3] = UInt64GetDatum(item->queryId);
-		else
-			values[3] = (Datum) 0;
+		if (used && result[n].generation > since)
+			n++;
+	}
 
-		values[4] = UInt64GetDatum(item->count);
+	count_read(retries);
+	*count = n;
+	return result;
+}
 
-		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+static int
+topn_entry_cmp(const void *a, const void *b)
+{
+	uint64		ca = ((const TopNEntry *) a)->item.count,
+				cb = ((const TopNEntry *) b)->item.count;
 
-		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
-	}
-	else
-	{
-		/* nothing left */
-		SRF_RETURN_DONE(funcctx);
-	}
+	if (ca > cb)
+		return -1;
+	return (ca < cb) ? 1 : 0;
 }
 
-PG_FUNCTION_INFO_V1(pg_wait_sampling_reset_profile);
-Datum
-pg_wait_sampling_reset_profile(PG_FUNCTION_ARGS)
+/*
+ * Copy consistent snapshot of heavy hitters profile, the largest counts
+ * first.
+ */
+static TopNEntry *
+read_topn(Size *count)
 {
-	LOCKTAG		collectorTag;
+	volatile TopNTable *table = pgws_topn_table;
+	TopNEntry  *result;
+	uint32		n,
+				i,
+				generation;
+	uint64		retries = 0;
 
-	check_shmem();
+	result = (TopNEntry *) palloc(sizeof(TopNEntry) * Max(table->maxEntries, 1));
 
-	pgws_init_lock_tag(&queueTag, PGWS_QUEUE_LOCK);
+	/* Retry the whole scan if the table was reset while we read it */
+	for (;;)
+	{
+		generation = table->changecount;
+		pg_read_barrier();
+		n = table->nentries;
+		pg_read_barrier();
 
-	LockAcquire(&queueTag, ExclusiveLock, false, false);
+		for (i = 0; i < n; i++)
+		{
+			volatile TopNEntry *entry = &table->entries[i];
+			uint32		before,
+						after;
 
-	pgws_init_lock_tag(&collectorTag, PGWS_COLLECTOR_LOCK);
-	LockAcquire(&collectorTag, ExclusiveLock, false, false);
-	pgws_collector_hdr->request = PROFILE_RESET;
-	LockRelease(&collectorTag, ExclusiveLock, false);
+			/* Retry until we read the entry while the collector doesn't change it */
+			for (;;)
+			{
+				before = entry->changecount;
+				pg_read_barrier();
+				result[i] = *entry;
+				pg_read_barrier();
+				after = entry->changecount;
+
+				if (before == after && (before & 1) == 0)
+					break;
+				retries++;
+			}
+		}
 
-	SetLatch(pgws_collector_hdr->latch);
+		pg_read_barrier();
+		if ((generation & 1) == 0 && table->changecount == generation)
+			break;
+		retries++;
+	}
 
-	LockRelease(&queueTag, ExclusiveLock, false);
+	if (n > 1)
+		qsort(result, n, sizeof(TopNEntry), topn_entry_cmp);
 
-	PG_RETURN_VOID();
+	count_read(retries);
+	*count = n;
+	return result;
 }
 
-PG_FUNCTION_INFO_V1(pg_wait_sampling_get_history);
-Datum
-pg_wait_sampling_get_history(PG_FUNCTION_ARGS)
+/*
+ * Get waits history ring of given collector shard.  It's either preallocated
+ * in shared memory or held in the DSM segment, which is returned in *segment
+ * and should be detached by the caller.  The collector replaces the segment
+ * when history size changes, so retry a few times if the published segment
+ * went away under us.
+ */
+static HistoryRing *
+attach_history(CollectorShard *shard, dsm_segment **segment)
 {
-	History				*history;
-	FuncCallContext		*funcctx;
+	int			attempts;
 
-	check_shmem();
+	*segment = NULL;
+	if (shard->shmemHistory != NULL)
+		return shard->shmemHistory;
 
-	if (SRF_IS_FIRSTCALL())
+	for (attempts = 0; attempts < 10; attempts++)
 	{
-		MemoryContext	oldcontext;
-		TupleDesc		tupdesc;
+		dsm_handle	handle = ((volatile CollectorShard *) shard)->historyHandle;
+		dsm_segment *seg;
 
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		if (handle == DSM_HANDLE_INVALID)
+			break;
 
-		/* Receive history from shmq */
-		history = (History *) palloc0(sizeof(History));
-		history->items = (HistoryItem *) receive_array(HISTORY_REQUEST,
-										sizeof(HistoryItem), &history->count);
-
-		funcctx->user_fctx = history;
-		funcctx->max_calls = history->count;
+		seg = dsm_attach(handle);
+		if (seg != NULL)
+		{
+			HistoryRing *ring = (HistoryRing *) dsm_segment_address(seg);
 
-		/* Make tuple descriptor */
-		tupdesc = CreateTemplateTupleDescCompat(5, false);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pid",
-						   INT4OID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "sample_ts",
-						   TIMESTAMPTZOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "type",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "event",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "queryid",
-						   INT8OID, -1, 0);
-		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+			if (ring->magic != PG_WAIT_SAMPLING_MAGIC)
+				ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+								errmsg("pg_wait_sampling history segment has invalid magic number")));
+			*segment = seg;
+			return ring;
+		}
 
-		MemoryContextSwitchTo(oldcontext);
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(1000L);
 	}
 
-	/* stuff done on every call of the function */
-	funcctx = SRF_PERCALL_SETUP();
+	ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+					errmsg("pg_wait_sampling collector wasn't started")));
+	return NULL;
+}
 
-	history = (History *) funcctx->user_fctx;
+/* How much of a history ring readers copy at once */
+#define HISTORY_READ_CHUNK		(64 * 1024)
 
-	if (history->index < history->count)
-	{
-		HeapTuple	tuple;
-		HistoryItem *item;
-		Datum		values[5];
-		bool		nulls[5];
-		const char *event_type,
-				   *event;
+/*
+ * Scan of waits history, or of captured waits, of all collector shards,
+ * merged by timestamp.  Rings are read by chunks, so reading backends take
+ * about HISTORY_READ_CHUNK per shard whatever the size of history.
+ */
+typedef struct
+{
+	int				nshards;
+	dsm_segment	  **segments;
+	HistoryCursor **cursors;
+	HistoryItem	  **heads;		/* next item of every shard, or NULL */
+	HistoryItem		current;
+} HistoryScan;
+
+static void
+history_scan_begin(HistoryScan *scan, const HistoryFilter *filter,
+				   bool capture)
+{
+	int			i;
 
-		item = &history->items[history->index];
+	scan->nshards = pgws_collector_hdr->nshards;
+	scan->segments = (dsm_segment **) palloc0(sizeof(dsm_segment *) * scan->nshards);
+	scan->cursors = (HistoryCursor **) palloc0(sizeof(HistoryCursor *) * scan->nshards);
+	scan->heads = (HistoryItem **) palloc0(sizeof(HistoryItem *) * scan->nshards);
 
-		/* Make and return next tuple to caller */
-		MemSet(values, 0, sizeof(values));
-		MemSet(nulls, 0, sizeof(nulls));
+	for (i = 0; i < scan->nshards; i++)
+	{
+		CollectorShard *shard = &pgws_collector_hdr->shards[i];
+		HistoryRing *ring;
 
-		event_type = pgstat_get_wait_event_type(item->wait_event_info);
-		event = pgstat_get_wait_event(item->wait_event_info);
-		values[0] = Int32GetDatum(item->pid);
-		values[1] = TimestampTzGetDatum(item->ts);
-		if (event_type)
-			values[2] = PointerGetDatum(cstring_to_text(event_type));
+		if (capture)
+			ring = shard->captureRing;
 		else
-			nulls[2] = true;
-		if (event)
-			values[3] = PointerGetDatum(cstring_to_text(event));
-		else
-			nulls[3] = true;
-
-		values[4] = UInt64GetDatum(item->queryId);
-		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+			ring = attach_history(shard, &scan->segments[i]);
+		if (ring == NULL)
+			continue;
 
-		history->index++;
-		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
-	}
-	else
-	{
-		/* nothing left */
-		SRF_RETURN_DONE(funcctx);
+		scan->cursors[i] = pgws_history_cursor_open(ring, filter,
+													HISTORY_READ_CHUNK);
+		scan->heads[i] = pgws_history_cursor_next(scan->cursors[i]);
 	}
-
-	PG_RETURN_VOID();
 }
 
 /*
- * planner_hook hook, save queryId for collector
+ * Next sample of the scan, or NULL if there are no more.  Samples of the
+ * same timestamp go in the order of shards.
  */
-static PlannedStmt *
-pgws_planner_hook(Query *parse,
-#if PG_VERSION_NUM >= 130000
-				  const char *query_string,
-#endif
-				  int cursorOptions,
-				  ParamListInfo boundParams)
+static HistoryItem *
+history_scan_next(HistoryScan *scan)
 {
-	if (MyProc)
-	{
-		int i = MyProc - ProcGlobal->allProcs;
-#if PG_VERSION_NUM >= 110000
-		/*
-		 * since we depend on queryId we need to check that its size
-		 * is uint64 as we coded in pg_wait_sampling
-		 */
-		StaticAssertExpr(sizeof(parse->queryId) == sizeof(uint64),
-				"queryId size is not uint64");
-#else
-		StaticAssertExpr(sizeof(parse->queryId) == sizeof(uint32),
-				"queryId size is not uint32");
-#endif
-		if (!pgws_proc_queryids[i])
-			pgws_proc_queryids[i] = parse->queryId;
+	int			best = -1,
+				i;
 
+	for (i = 0; i < scan->nshards; i++)
+	{
+		if (scan->heads[i] != NULL &&
+			(best < 0 || scan->heads[i]->ts < scan->heads[best]->ts))
+			best = i;
 	}
+	if (best < 0)
+		return NULL;
 
-	/* Invoke original hook if needed */
-	if (planner_hook_next)
-		return planner_hook_next(parse,
-#if PG_VERSION_NUM >= 130000
-				query_string,
-#endif
-				cursorOptions, boundParams);
+	/* The cursor may free the item once it moves to the next chunk */
+	scan->current = *scan->heads[best];
+	scan->heads[best] = pgws_history_cursor_next(scan->cursors[best]);
+	return &scan->current;
+}
+
+static void
+history_scan_end(HistoryScan *scan)
+{
+	int			i;
+
+	for (i = 0; i < scan->nshards; i++)
+	{
+		if (scan->cursors[i] != NULL)
+			pgws_history_cursor_close(scan->cursors[i]);
+		if (scan->segments[i] != NULL)
+			dsm_detach(scan->segments[i]);
+	}
+	pfree(scan->segments);
+	pfree(scan->cursors);
+	pfree(scan->heads);
+	count_read(0);
+}
+
+/*
+ * Copy consistent snapshot of wait duration histograms as the list of their
+ * non-empty buckets.
+ */
+static HistogramBucket *
+read_histograms(Size *count)
+{
+	volatile WaitHistogramTable *table = pgws_histogram_table;
+	HistogramBucket *result;
+	Size		n = 0,
+				allocated = 64;
+	uint32		i;
+	uint64		retries = 0;
+
+	result = (HistogramBucket *) palloc(sizeof(HistogramBucket) * allocated);
+
+	for (i = 0; i < table->nslots; i++)
+	{
+		volatile WaitHistogramSlot *slot = &table->slots[i];
+		WaitHistogram hist;
+		uint32		before,
+					after;
+		bool		used;
+		int			j;
+
+		/* Retry until we read the slot while the collector doesn't change it */
+		for (;;)
+		{
+			before = slot->changecount;
+			pg_read_barrier();
+			used = slot->used;
+			if (used)
+				hist = slot->item;
+			pg_read_barrier();
+			after = slot->changecount;
+
+			if (before == after && (before & 1) == 0)
+				break;
+			retries++;
+		}
+
+		if (!used)
+			continue;
+
+		for (j = 0; j < WAIT_HISTOGRAM_BUCKETS; j++)
+		{
+			if (hist.buckets[j] == 0)
+				continue;
+
+			if (n >= allocated)
+			{
+				allocated *= 2;
+				result = (HistogramBucket *) repalloc(result,
+										sizeof(HistogramBucket) * allocated);
+			}
+			result[n].wait_event_info = hist.wait_event_info;
+			result[n].queryId = hist.queryId;
+			result[n].bucket = j;
+			result[n].count = hist.buckets[j];
+			n++;
+		}
+	}
+
+	count_read(retries);
+	*count = n;
+	return result;
+}
+
+/* Profile entry of series bucket */
+typedef struct
+{
+	TimestampTz		start_ts;
+	ProfileItem		item;
+} SeriesItem;
+
+/*
+ * Copy profile series buckets overlapping [from, to], the oldest first.
+ */
+static SeriesItem *
+read_series(TimestampTz from, TimestampTz to, Size *count)
+{
+	volatile ProfileSeries *series = pgws_profile_series;
+	SeriesItem *result;
+	Size		n = 0,
+				allocated = 64;
+	int			i;
+
+	result = (SeriesItem *) palloc(sizeof(SeriesItem) * allocated);
+
+	for (i = 1; i <= series->nbuckets; i++)
+	{
+		int			b = (series->current + i) % series->nbuckets;
+		volatile SeriesBucket *bucket = &series->buckets[b];
+
+		/* Retry if the collector reused the bucket while we read it */
+		for (;;)
+		{
+			uint32		before,
+						after;
+			TimestampTz	start;
+			ProfileItem *items;
+			Size		nitems,
+						j;
+
+			before = bucket->changecount;
+			pg_read_barrier();
+			start = bucket->start_ts;
+			if ((before & 1) != 0)
+				continue;
+			if (start == 0 || start > to || start + series->resolution <= from)
+				break;
+
+			items = read_profile(pgws_series_table(series, b), 0, &nitems);
+			pg_read_barrier();
+			after = bucket->changecount;
+			if (before != after)
+			{
+				pfree(items);
+				continue;
+			}
+
+			if (n + nitems > allocated)
+			{
+				while (n + nitems > allocated)
+					allocated *= 2;
+				result = (SeriesItem *) repalloc(result,
+												 sizeof(SeriesItem) * allocated);
+			}
+			for (j = 0; j < nitems; j++)
+			{
+				result[n].start_ts = start;
+				result[n].item = items[j];
+				n++;
+			}
+			pfree(items);
+			break;
+		}
+	}
+
+	*count = n;
+	return result;
+}
+
+/*
+ * Resolve ids of queryIds of count profile items lying stride bytes apart,
+ * since items of heavy hitters and series are parts of larger entries.
+ * Callers copy the items again if the dictionary generation taken before the
+ * copy has changed after this, as ids may belong to other queryIds then.
+ */
+static uint64 *
+resolve_query_ids(const ProfileItem *items, Size count, Size stride)
+{
+	uint64	   *result = (uint64 *) palloc(sizeof(uint64) * Max(count, 1));
+	Size		i;
+
+	for (i = 0; i < count; i++)
+	{
+		const ProfileItem *item = (const ProfileItem *)
+			((const char *) items + i * stride);
+
+		result[i] = pgws_query_dict_get(pgws_query_dict, item->queryRef);
+	}
+	return result;
+}
+
+/*
+ * Common part of pg_wait_sampling_get_profile(),
+ * pg_wait_sampling_get_profile_delta() and
+ * pg_wait_sampling_get_profile_extended().  Returns entries updated after
+ * given generation, with their last update generation if with_generation is
+ * set, and with database, role and backend type if with_dims is set.
+ */
+static Datum
+get_profile_internal(FunctionCallInfo fcinfo, uint64 since,
+					 bool with_generation, bool with_dims)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ProfileItem	   *items;
+	uint64		   *queryIds;
+	Size			count,
+					i;
+	uint32			generation;
+	bool			profileQueries;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	/* Copy profile from shared memory table along with its queryIds */
+	for (;;)
+	{
+		generation = pgws_query_dict_generation(pgws_query_dict);
+		items = read_profile(pgws_profile_table, since, &count);
+		queryIds = resolve_query_ids(items, count, sizeof(ProfileItem));
+		if (pgws_query_dict_generation(pgws_query_dict) == generation)
+			break;
+		pfree(items);
+		pfree(queryIds);
+	}
+	profileQueries = pgws_collector_hdr->profileQueries;
+
+	for (i = 0; i < count; i++)
+	{
+		Datum		values[8];
+		bool		nulls[8];
+		ProfileItem *item = &items[i];
+		int			j = 5;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(item->pid);
+		get_wait_event_text(item->wait_event_info, &values[1], &nulls[1]);
+		values[3] = UInt64GetDatum(profileQueries ? queryIds[i] : 0);
+		values[4] = UInt64GetDatum((item->count + PROFILE_COUNT_SCALE / 2) /
+								   PROFILE_COUNT_SCALE);
+		if (with_generation)
+			values[j++] = UInt64GetDatum(item->generation);
+		if (with_dims)
+		{
+			if (OidIsValid(item->databaseId))
+				values[j] = ObjectIdGetDatum(item->databaseId);
+			else
+				nulls[j] = true;
+			j++;
+			if (OidIsValid(item->roleId))
+				values[j] = ObjectIdGetDatum(item->roleId);
+			else
+				nulls[j] = true;
+			j++;
+			if (item->backendType != PGWS_BACKEND_UNKNOWN)
+				values[j] = get_backend_type_text(item->backendType);
+			else
+				nulls[j] = true;
+		}
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(items);
+	pfree(queryIds);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile);
+Datum
+pg_wait_sampling_get_profile(PG_FUNCTION_ARGS)
+{
+	return get_profile_internal(fcinfo, 0, false, false);
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile_delta);
+Datum
+pg_wait_sampling_get_profile_delta(PG_FUNCTION_ARGS)
+{
+	int64		since = PG_GETARG_INT64(0);
+
+	check_shmem();
+
+	/* Everything is changed if the profile was reset since then */
+	if (since < (int64) pg_atomic_read_u64(&pgws_profile_table->resetGeneration))
+		since = 0;
+
+	return get_profile_internal(fcinfo, (uint64) Max(since, 0), true, false);
+}
+
+/*
+ * Get waits profile along with database, role and backend type dimensions.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile_extended);
+Datum
+pg_wait_sampling_get_profile_extended(PG_FUNCTION_ARGS)
+{
+	return get_profile_internal(fcinfo, 0, false, true);
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile_generation);
+Datum
+pg_wait_sampling_get_profile_generation(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2];
+
+	check_shmem();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = UInt64GetDatum(pg_atomic_read_u64(&pgws_profile_table->generation));
+	values[1] = UInt64GetDatum(pg_atomic_read_u64(&pgws_profile_table->resetGeneration));
+
+	return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls));
+}
+
+/*
+ * Get heavy hitters of waits profile.  Counts are upper bounds, which may
+ * exceed true counts by error at most.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile_topn);
+Datum
+pg_wait_sampling_get_profile_topn(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TopNEntry	   *entries;
+	uint64		   *queryIds;
+	Size			count,
+					i;
+	uint32			generation;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	for (;;)
+	{
+		generation = pgws_query_dict_generation(pgws_query_dict);
+		entries = read_topn(&count);
+		queryIds = resolve_query_ids(&entries[0].item, count, sizeof(TopNEntry));
+		if (pgws_query_dict_generation(pgws_query_dict) == generation)
+			break;
+		pfree(entries);
+		pfree(queryIds);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		Datum		values[6];
+		bool		nulls[6];
+		ProfileItem *item = &entries[i].item;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(item->pid);
+		get_wait_event_text(item->wait_event_info, &values[1], &nulls[1]);
+		values[3] = UInt64GetDatum(queryIds[i]);
+		values[4] = UInt64GetDatum((item->count + PROFILE_COUNT_SCALE / 2) /
+								   PROFILE_COUNT_SCALE);
+		values[5] = UInt64GetDatum((entries[i].error + PROFILE_COUNT_SCALE / 2) /
+								   PROFILE_COUNT_SCALE);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(entries);
+	pfree(queryIds);
+
+	return (Datum) 0;
+}
+
+/*
+ * Ids of queryIds interned in waits profile.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_queryids);
+Datum
+pg_wait_sampling_get_queryids(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	uint32			nentries,
+					id;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	nentries = pg_atomic_read_u32(&pgws_query_dict->nentries);
+	pg_read_barrier();
+
+	for (id = 1; id <= nentries; id++)
+	{
+		Datum		values[2];
+		bool		nulls[2];
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum((int32) id);
+		values[1] = UInt64GetDatum(pgws_query_dict->queryIds[id - 1]);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_profile_series);
+Datum
+pg_wait_sampling_get_profile_series(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SeriesItem	   *entries;
+	uint64		   *queryIds;
+	Size			count,
+					i;
+	uint32			generation;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	/* Copy buckets from shared memory along with their queryIds */
+	for (;;)
+	{
+		generation = pgws_query_dict_generation(pgws_query_dict);
+		entries = read_series(PG_GETARG_TIMESTAMPTZ(0),
+							  PG_GETARG_TIMESTAMPTZ(1), &count);
+		queryIds = resolve_query_ids(&entries[0].item, count, sizeof(SeriesItem));
+		if (pgws_query_dict_generation(pgws_query_dict) == generation)
+			break;
+		pfree(entries);
+		pfree(queryIds);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		Datum		values[6];
+		bool		nulls[6];
+		ProfileItem *item = &entries[i].item;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = TimestampTzGetDatum(entries[i].start_ts);
+		values[1] = Int32GetDatum(item->pid);
+		get_wait_event_text(item->wait_event_info, &values[2], &nulls[2]);
+
+		if (pgws_collector_hdr->profileQueries)
+			values[4] = UInt64GetDatum(queryIds[i]);
+		else
+			values[4] = (Datum) 0;
+
+		values[5] = UInt64GetDatum((item->count + PROFILE_COUNT_SCALE / 2) /
+								   PROFILE_COUNT_SCALE);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(entries);
+	pfree(queryIds);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_reset_profile);
+Datum
+pg_wait_sampling_reset_profile(PG_FUNCTION_ARGS)
+{
+	check_shmem();
+
+	pgws_reset_profile();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Common part of pg_wait_sampling_get_history(),
+ * pg_wait_sampling_get_history_filtered() and pg_wait_sampling_get_capture().
+ * Rows go to the tuplestore as the rings are scanned, since the tuplestore
+ * spills to disk beyond work_mem.
+ */
+static Datum
+get_history_rows(FunctionCallInfo fcinfo, const HistoryFilter *filter,
+				 bool capture)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HistoryScan		scan;
+	HistoryItem	   *item;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	history_scan_begin(&scan, filter, capture);
+	while ((item = history_scan_next(&scan)) != NULL)
+	{
+		Datum		values[5];
+		bool		nulls[5];
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(item->pid);
+		values[1] = TimestampTzGetDatum(item->ts);
+		get_wait_event_text(item->wait_event_info, &values[2], &nulls[2]);
+		values[4] = UInt64GetDatum(item->queryId);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	history_scan_end(&scan);
+
+	return (Datum) 0;
+}
+
+/*
+ * Get persisted waits history within given range.  Batches are read from
+ * disk one by one, and rows go to the tuplestore, which spills to disk beyond
+ * work_mem.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_persisted_history);
+Datum
+pg_wait_sampling_get_persisted_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	PersistReader  *reader;
+	HistoryItem	   *items;
+	Size			count,
+					i;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	reader = pgws_persist_begin_read(PG_GETARG_TIMESTAMPTZ(0),
+									 PG_GETARG_TIMESTAMPTZ(1));
+	while ((items = pgws_persist_read_next(reader, &count)) != NULL)
+	{
+		for (i = 0; i < count; i++)
+		{
+			HistoryItem *item = &items[i];
+			Datum		values[5];
+			bool		nulls[5];
+
+			MemSet(values, 0, sizeof(values));
+			MemSet(nulls, 0, sizeof(nulls));
+
+			values[0] = Int32GetDatum(item->pid);
+			values[1] = TimestampTzGetDatum(item->ts);
+			get_wait_event_text(item->wait_event_info, &values[2], &nulls[2]);
+			values[4] = UInt64GetDatum(item->queryId);
+
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+		}
+		pfree(items);
+	}
+	pgws_persist_end_read(reader);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_wait_histogram);
+Datum
+pg_wait_sampling_get_wait_histogram(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HistogramBucket *buckets;
+	Size			count,
+					i;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	/* Copy histograms from shared memory table */
+	buckets = read_histograms(&count);
+
+	for (i = 0; i < count; i++)
+	{
+		Datum		values[6];
+		bool		nulls[6];
+		HistogramBucket *item = &buckets[i];
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		get_wait_event_text(item->wait_event_info, &values[0], &nulls[0]);
+
+		values[2] = UInt64GetDatum(item->queryId);
+		values[3] = Int64GetDatum(item->bucket == 0 ? 0 : (int64) 1 << item->bucket);
+		if (item->bucket < WAIT_HISTOGRAM_BUCKETS - 1)
+			values[4] = Int64GetDatum((int64) 2 << item->bucket);
+		else
+			nulls[4] = true;
+		values[5] = UInt64GetDatum(item->count);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(buckets);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_history);
+Datum
+pg_wait_sampling_get_history(PG_FUNCTION_ARGS)
+{
+	return get_history_rows(fcinfo, NULL, false);
+}
+
+/*
+ * Get waits history restricted by given pid, queryid, wait event type and
+ * name, and the earliest sample time.  NULL arguments don't restrict
+ * anything.  Conditions are checked while decoding the ring, so samples
+ * which don't pass them are never materialized.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_history_filtered);
+Datum
+pg_wait_sampling_get_history_filtered(PG_FUNCTION_ARGS)
+{
+	HistoryFilter	filter;
+
+	MemSet(&filter, 0, sizeof(filter));
+	if (!PG_ARGISNULL(0))
+		filter.pid = PG_GETARG_INT32(0);
+	if (!PG_ARGISNULL(1))
+	{
+		filter.hasQueryId = true;
+		filter.queryId = (uint64) PG_GETARG_INT64(1);
+	}
+	if (!PG_ARGISNULL(2))
+		filter.eventType = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	if (!PG_ARGISNULL(3))
+		filter.event = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	if (!PG_ARGISNULL(4))
+	{
+		filter.hasSince = true;
+		filter.since = PG_GETARG_TIMESTAMPTZ(4);
+	}
+
+	return get_history_rows(fcinfo, &filter, false);
+}
+
+/*
+ * Get waits history with wait event as raw wait_event_info.  Fixed-width
+ * columns are cheap to produce and to ship with binary COPY; names may be
+ * looked up once with pg_wait_sampling_get_wait_events().
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_history_raw);
+Datum
+pg_wait_sampling_get_history_raw(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HistoryScan		scan;
+	HistoryItem	   *item;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	history_scan_begin(&scan, NULL, false);
+	while ((item = history_scan_next(&scan)) != NULL)
+	{
+		Datum		values[4];
+		bool		nulls[4];
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(item->pid);
+		values[1] = TimestampTzGetDatum(item->ts);
+		values[2] = Int32GetDatum((int32) item->wait_event_info);
+		values[3] = UInt64GetDatum(item->queryId);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	history_scan_end(&scan);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_capture);
+Datum
+pg_wait_sampling_get_capture(PG_FUNCTION_ARGS)
+{
+	return get_history_rows(fcinfo, NULL, true);
+}
+
+/*
+ * State of waits capture and the trigger which fired it.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_capture_state);
+Datum
+pg_wait_sampling_get_capture_state(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
+	int			state;
+	const char *name;
+
+	check_shmem();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	MemSet(values, 0, sizeof(values));
+	MemSet(nulls, 0, sizeof(nulls));
+
+	LWLockAcquire(pgws_collector_hdr->aggregateLock, LW_SHARED);
+	state = pgws_collector_hdr->captureState;
+	if (state == CAPTURE_ARMED)
+	{
+		nulls[1] = nulls[2] = nulls[3] = nulls[4] = nulls[5] = true;
+	}
+	else
+	{
+		values[1] = TimestampTzGetDatum(pgws_collector_hdr->captureStart);
+		values[2] = TimestampTzGetDatum(pgws_collector_hdr->captureEnd);
+		get_wait_event_text(pgws_collector_hdr->captureEvent,
+							&values[3], &nulls[3]);
+		values[5] = Int32GetDatum(pgws_collector_hdr->captureWaiting);
+	}
+	LWLockRelease(pgws_collector_hdr->aggregateLock);
+
+	if (state == CAPTURE_ACTIVE)
+		name = "capturing";
+	else if (state == CAPTURE_FROZEN)
+		name = "frozen";
+	else if (pgws_collector_hdr->shards[0].captureRing == NULL ||
+			 !pgws_collector_hdr->captureEnabled)
+		name = "disabled";
+	else
+		name = "armed";
+	values[0] = CStringGetTextDatum(name);
+
+	return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls));
+}
+
+PG_FUNCTION_INFO_V1(pg_wait_sampling_reset_capture);
+Datum
+pg_wait_sampling_reset_capture(PG_FUNCTION_ARGS)
+{
+	check_shmem();
+
+	pgws_reset_capture();
+
+	PG_RETURN_VOID();
+}
+
+static int
+uint32_cmp(const void *a, const void *b)
+{
+	uint32		va = *(const uint32 *) a,
+				vb = *(const uint32 *) b;
+
+	if (va < vb)
+		return -1;
+	return (va > vb) ? 1 : 0;
+}
+
+/*
+ * Sort wait events and remove duplicates.  Returns the number left.
+ */
+static Size
+dedup_events(uint32 *events, Size count)
+{
+	Size		i,
+				n = 0;
+
+	if (count > 1)
+		qsort(events, count, sizeof(uint32), uint32_cmp);
+
+	for (i = 0; i < count; i++)
+	{
+		if (n == 0 || events[i] != events[n - 1])
+			events[n++] = events[i];
+	}
+	return n;
+}
+
+/*
+ * Dictionary of wait events: type and name of every wait_event_info
+ * currently present in history or profile.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_wait_events);
+Datum
+pg_wait_sampling_get_wait_events(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HistoryScan		scan;
+	HistoryItem	   *item;
+	ProfileItem	   *profile;
+	Size			profileCount,
+					count = 0,
+					allocated,
+					i;
+	uint32		   *events;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	profile = read_profile(pgws_profile_table, 0, &profileCount);
+
+	allocated = profileCount + 64;
+	events = (uint32 *) palloc(sizeof(uint32) * allocated);
+	for (i = 0; i < profileCount; i++)
+		events[count++] = profile[i].wait_event_info;
+
+	/*
+	 * Consecutive samples often share the event, those are taken just once.
+	 * The list is deduplicated once it's full, so it grows only with the
+	 * number of distinct events.
+	 */
+	history_scan_begin(&scan, NULL, false);
+	while ((item = history_scan_next(&scan)) != NULL)
+	{
+		if (count > 0 && events[count - 1] == item->wait_event_info)
+			continue;
+		if (count >= allocated)
+		{
+			count = dedup_events(events, count);
+			if (count >= allocated / 2)
+			{
+				allocated *= 2;
+				events = (uint32 *) repalloc(events, sizeof(uint32) * allocated);
+			}
+		}
+		events[count++] = item->wait_event_info;
+	}
+	history_scan_end(&scan);
+
+	count = dedup_events(events, count);
+
+	for (i = 0; i < count; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum((int32) events[i]);
+		get_wait_event_text(events[i], &values[1], &nulls[1]);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Get samples of heavyweight lock waits from history along with the lock
+ * and the process blocking it.  Lock details are NULL if they weren't
+ * resolved by the time of the sample.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_lock_history);
+Datum
+pg_wait_sampling_get_lock_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HistoryFilter	filter;
+	HistoryScan		scan;
+	HistoryItem	   *item;
+
+	check_shmem();
+
+	InitMaterializedSRFCompat(fcinfo);
+
+	MemSet(&filter, 0, sizeof(filter));
+	filter.eventType = "Lock";
+	history_scan_begin(&scan, &filter, false);
+	while ((item = history_scan_next(&scan)) != NULL)
+	{
+		Datum		values[11];
+		bool		nulls[11];
+		LOCKTAG	   *tag = &item->locktag;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(item->pid);
+		values[1] = TimestampTzGetDatum(item->ts);
+		get_wait_event_text(item->wait_event_info, &values[2], &nulls[2]);
+		values[4] = UInt64GetDatum(item->queryId);
+		if (item->hasLockInfo)
+		{
+			if (item->blockerPid != 0)
+				values[5] = Int32GetDatum((int32) item->blockerPid);
+			else
+				nulls[5] = true;
+			if (tag->locktag_type <= LOCKTAG_LAST_TYPE)
+				values[6] = PointerGetDatum(cstring_to_text(LockTagTypeNames[tag->locktag_type]));
+			else
+				nulls[6] = true;
+			values[7] = Int64GetDatum((int64) tag->locktag_field1);
+			values[8] = Int64GetDatum((int64) tag->locktag_field2);
+			values[9] = Int64GetDatum((int64) tag->locktag_field3);
+			values[10] = Int32GetDatum((int32) tag->locktag_field4);
+		}
+		else
+		{
+			int			j;
+
+			for (j = 5; j < 11; j++)
+				nulls[j] = true;
+		}
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	history_scan_end(&scan);
+
+	return (Datum) 0;
+}
+
+/*
+ * Make queryId of the statement being processed visible to the collector.
+ * Every hook below sets queryId of its statement for the time of the call
+ * and restores the previous one afterwards, so nested statements don't
+ * clobber queryId of outer ones.  Zero queryId leaves the outer one in
+ * place, and parallel workers take queryId of their leader.  Returns
+ * queryId to be restored by pop_queryid().
+ */
+static uint64
+push_queryid(uint64 queryId)
+{
+	uint64	   *slot,
+				saved;
+
+	if (!MyProc)
+		return UINT64CONST(0);
+
+	slot = &pgws_proc_queryids[MyProc - ProcGlobal->allProcs];
+	saved = *slot;
+	if (queryId == 0 && saved == 0 && IsParallelWorker() &&
+		MyProc->lockGroupLeader != NULL)
+		queryId = pgws_proc_queryids[MyProc->lockGroupLeader - ProcGlobal->allProcs];
+	if (queryId != 0)
+		*slot = queryId;
+
+	return saved;
+}
+
+static void
+pop_queryid(uint64 saved)
+{
+	if (MyProc)
+		pgws_proc_queryids[MyProc - ProcGlobal->allProcs] = saved;
+}
+
+/*
+ * Upper bound of log-scaled bucket of probe durations where given fraction
+ * of probes is reached.
+ */
+static uint64
+stats_percentile(const CollectorStats *stats, double fraction)
+{
+	uint64		total = 0,
+				sum = 0;
+	int			i;
+
+	for (i = 0; i < WAIT_HISTOGRAM_BUCKETS; i++)
+		total += stats->probeBuckets[i];
+	if (total == 0)
+		return 0;
 
-	return standard_planner(parse,
+	for (i = 0; i < WAIT_HISTOGRAM_BUCKETS - 1; i++)
+	{
+		sum += stats->probeBuckets[i];
+		if ((double) sum >= fraction * (double) total)
+			break;
+	}
+	return Min((uint64) 2 << i, stats->probeMaxUs);
+}
+
+/*
+ * Get statistics of the collector's own overhead.
+ */
+PG_FUNCTION_INFO_V1(pg_wait_sampling_get_collector_stats);
+Datum
+pg_wait_sampling_get_collector_stats(PG_FUNCTION_ARGS)
+{
+	CollectorStats	stats;
+	TupleDesc		tupdesc;
+	Datum			values[20];
+	bool			nulls[20];
+	int				i,
+					j;
+
+	check_shmem();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Sum up stats of collector shards */
+	MemSet(&stats, 0, sizeof(stats));
+	for (i = 0; i < pgws_collector_hdr->nshards; i++)
+	{
+		volatile CollectorStats *shared = &pgws_collector_hdr->shards[i].stats;
+		CollectorStats	shard;
+		uint32			before,
+						after;
+
+		/* Retry until we read the stats while the collector doesn't change them */
+		for (;;)
+		{
+			before = shared->changecount;
+			pg_read_barrier();
+			shard = *shared;
+			pg_read_barrier();
+			after = shared->changecount;
+
+			if (before == after && (before & 1) == 0)
+				break;
+		}
+
+		stats.ticks += shard.ticks;
+		stats.missedTicks += shard.missedTicks;
+		stats.lagTimeUs += shard.lagTimeUs;
+		stats.lagMaxUs = Max(stats.lagMaxUs, shard.lagMaxUs);
+		stats.probeTimeUs += shard.probeTimeUs;
+		stats.probeMaxUs = Max(stats.probeMaxUs, shard.probeMaxUs);
+		for (j = 0; j < WAIT_HISTOGRAM_BUCKETS; j++)
+			stats.probeBuckets[j] += shard.probeBuckets[j];
+		stats.lockTimeUs += shard.lockTimeUs;
+		stats.historyWritten += shard.historyWritten;
+		stats.historyOverwritten += shard.historyOverwritten;
+		stats.historyCapacity += shard.historyCapacity;
+	}
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = UInt64GetDatum(stats.ticks);
+	values[1] = UInt64GetDatum(stats.missedTicks);
+	values[2] = UInt64GetDatum(stats.lagTimeUs);
+	values[3] = UInt64GetDatum(stats.lagMaxUs);
+	values[4] = UInt64GetDatum(stats.probeTimeUs);
+	values[5] = UInt64GetDatum(stats_percentile(&stats, 0.5));
+	values[6] = UInt64GetDatum(stats_percentile(&stats, 0.99));
+	values[7] = UInt64GetDatum(stats.probeMaxUs);
+	values[8] = UInt64GetDatum(stats.lockTimeUs);
+	values[9] = UInt64GetDatum(((volatile ProfileTable *) pgws_profile_table)->nentries);
+	values[10] = UInt64GetDatum(((volatile ProfileTable *) pgws_profile_table)->overflow);
+	values[11] = UInt64GetDatum(get_profile_table_size(pgws_profile_table->maxEntries));
+	values[12] = UInt64GetDatum(stats.historyCapacity);
+	values[13] = UInt64GetDatum(stats.historyWritten);
+	values[14] = UInt64GetDatum(stats.historyOverwritten);
+	values[15] = UInt64GetDatum(pgws_shmem_size());
+	values[16] = UInt64GetDatum(pg_atomic_read_u64(&pgws_collector_hdr->reads));
+	values[17] = UInt64GetDatum(pg_atomic_read_u64(&pgws_collector_hdr->readRetries));
+	values[18] = UInt64GetDatum(pg_atomic_read_u32(&pgws_query_dict->nentries));
+	values[19] = UInt64GetDatum(((volatile QueryIdDict *) pgws_query_dict)->overflow);
+
+	return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls));
+}
+
+/*
+ * planner_hook hook, save queryId for collector
+ */
+static PlannedStmt *
+pgws_planner_hook(Query *parse,
+#if PG_VERSION_NUM >= 130000
+				  const char *query_string,
+#endif
+				  int cursorOptions,
+				  ParamListInfo boundParams)
+{
+	PlannedStmt *result;
+	uint64		saved;
+
+#if PG_VERSION_NUM >= 110000
+	/*
+	 * since we depend on queryId we need to check that its size
+	 * is uint64 as we coded in pg_wait_sampling
+	 */
+	StaticAssertExpr(sizeof(parse->queryId) == sizeof(uint64),
+			"queryId size is not uint64");
+#else
+	StaticAssertExpr(sizeof(parse->queryId) == sizeof(uint32),
+			"queryId size is not uint32");
+#endif
+	saved = push_queryid(parse->queryId);
+
+	PG_TRY();
+	{
+		/* Invoke original hook if needed */
+		if (planner_hook_next)
+			result = planner_hook_next(parse,
 #if PG_VERSION_NUM >= 130000
-				query_string,
+					query_string,
+#endif
+					cursorOptions, boundParams);
+		else
+			result = standard_planner(parse,
+#if PG_VERSION_NUM >= 130000
+					query_string,
+#endif
+					cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		pop_queryid(saved);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pop_queryid(saved);
+	return result;
+}
+
+/*
+ * ExecutorStart hook: set queryId while the executor starts
+ */
+static void
+pgws_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	uint64		saved = push_queryid(queryDesc->plannedstmt->queryId);
+
+	PG_TRY();
+	{
+		if (prev_ExecutorStart)
+			prev_ExecutorStart(queryDesc, eflags);
+		else
+			standard_ExecutorStart(queryDesc, eflags);
+	}
+	PG_CATCH();
+	{
+		pop_queryid(saved);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pop_queryid(saved);
+}
+
+/*
+ * ExecutorRun hook: set queryId while the query runs
+ */
+static void
+pgws_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count
+#if PG_VERSION_NUM >= 100000
+				 , bool execute_once
+#endif
+				 )
+{
+	uint64		saved = push_queryid(queryDesc->plannedstmt->queryId);
+
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count
+#if PG_VERSION_NUM >= 100000
+							 , execute_once
+#endif
+							 );
+		else
+			standard_ExecutorRun(queryDesc, direction, count
+#if PG_VERSION_NUM >= 100000
+								 , execute_once
 #endif
-			cursorOptions, boundParams);
+								 );
+	}
+	PG_CATCH();
+	{
+		pop_queryid(saved);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pop_queryid(saved);
 }
 
 /*
- * ExecutorEnd hook: clear queryId
+ * ExecutorFinish hook: set queryId while AFTER triggers fire
+ */
+static void
+pgws_ExecutorFinish(QueryDesc *queryDesc)
+{
+	uint64		saved = push_queryid(queryDesc->plannedstmt->queryId);
+
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+	}
+	PG_CATCH();
+	{
+		pop_queryid(saved);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pop_queryid(saved);
+}
+
+/*
+ * ExecutorEnd hook: set queryId while the executor shuts down
  */
 static void
 pgws_ExecutorEnd(QueryDesc *queryDesc)
 {
-	if (MyProc)
-		pgws_proc_queryids[MyProc - ProcGlobal->allProcs] = UINT64CONST(0);
+	uint64		saved = push_queryid(queryDesc->plannedstmt->queryId);
 
-	if (prev_ExecutorEnd)
-		prev_ExecutorEnd(queryDesc);
-	else
-		standard_ExecutorEnd(queryDesc);
+	PG_TRY();
+	{
+		if (prev_ExecutorEnd)
+			prev_ExecutorEnd(queryDesc);
+		else
+			standard_ExecutorEnd(queryDesc);
+	}
+	PG_CATCH();
+	{
+		pop_queryid(saved);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pop_queryid(saved);
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * ProcessUtility hook: set queryId of utility statement, if it has one
+ */
+static void
+pgws_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+#if PG_VERSION_NUM >= 140000
+					bool readOnlyTree,
+#endif
+					ProcessUtilityContext context, ParamListInfo params,
+					QueryEnvironment *queryEnv, DestReceiver *dest,
+#if PG_VERSION_NUM >= 130000
+					QueryCompletion *qc
+#else
+					char *completionTag
+#endif
+					)
+{
+	uint64		saved = push_queryid(pstmt->queryId);
+
+	PG_TRY();
+	{
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString,
+#if PG_VERSION_NUM >= 140000
+								readOnlyTree,
+#endif
+								context, params, queryEnv, dest,
+#if PG_VERSION_NUM >= 130000
+								qc
+#else
+								completionTag
+#endif
+								);
+		else
+			standard_ProcessUtility(pstmt, queryString,
+#if PG_VERSION_NUM >= 140000
+									readOnlyTree,
+#endif
+									context, params, queryEnv, dest,
+#if PG_VERSION_NUM >= 130000
+									qc
+#else
+									completionTag
+#endif
+									);
+	}
+	PG_CATCH();
+	{
+		pop_queryid(saved);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pop_queryid(saved);
 }
+#endif
@@ -17,22 +17,49 @@
 	#error "You are trying to build pg_wait_sampling with PostgreSQL version lower than 9.6.  Please, check you environment."
 #endif
 
+#include "port/atomics.h"
+#include "storage/dsm.h"
+#include "storage/lwlock.h"
 #include "storage/proc.h"
-#include "storage/shm_mq.h"
 #include "utils/timestamp.h"
 
 #define	PG_WAIT_SAMPLING_MAGIC		0xCA94B107
-#define COLLECTOR_QUEUE_SIZE		(16 * 1024)
 #define HISTORY_TIME_MULTIPLIER		10
-#define PGWS_QUEUE_LOCK				0
-#define PGWS_COLLECTOR_LOCK			1
 
+/*
+ * Levels of adaptive sampling.  Sampling periods are configured ones
+ * multiplied by 2^-level.  Every sample of the profile is counted with the
+ * weight of PROFILE_COUNT_SCALE per configured period passed since the
+ * previous sample, so that counts are comparable across rates.
+ */
+#define ADAPTIVE_IDLE_LEVEL		(-2)
+#define ADAPTIVE_MAX_LEVEL		4
+#define PROFILE_COUNT_SCALE		(1 << ADAPTIVE_MAX_LEVEL)
+
+/*
+ * Coarse types of processes, which PGPROC allows to tell apart, for the
+ * backend type dimension of waits profile.
+ */
+#define PGWS_BACKEND_UNKNOWN		0
+#define PGWS_BACKEND_REGULAR		1
+#define PGWS_BACKEND_AUTOVACUUM		2
+#define PGWS_BACKEND_BGWORKER		3
+#define PGWS_BACKEND_AUXILIARY		4
+
+/*
+ * Profile entry.  Key dimensions which are turned off by GUCs are zero.
+ * queryId is interned in pgws_query_dict, which keeps the key in 24 bytes.
+ */
 typedef struct
 {
 	uint32			pid;
 	uint32			wait_event_info;
-	uint64			queryId;
-	uint64			count;
+	uint32			queryRef;	/* id in queryId dictionary, 0 for none */
+	Oid				databaseId;
+	Oid				roleId;
+	uint8			backendType;	/* PGWS_BACKEND_* */
+	uint64			count;		/* in 1/PROFILE_COUNT_SCALE of sample */
+	uint64			generation;	/* generation of the last update */
 } ProfileItem;
 
 typedef struct
@@ -41,43 +68,438 @@ typedef struct
 	uint32			wait_event_info;
 	uint64			queryId;
 	TimestampTz		ts;
+
+	/*
+	 * Heavyweight lock waited for and the process holding conflicting lock,
+	 * known only with pg_wait_sampling.lock_blockers.  blockerPid is 0 if
+	 * nobody holds conflicting lock any more.
+	 */
+	bool			hasLockInfo;
+	uint32			blockerPid;
+	LOCKTAG			locktag;
 } HistoryItem;
 
+/*
+ * Waits history ring.  It lives in a DSM segment created by the collector,
+ * which is the only writer.  Backends attach to the segment and copy data
+ * out directly without disturbing the collector.
+ *
+ * History is kept in compact encoding (see history.c) as a circular byte
+ * buffer.  tail and head are absolute byte positions of the oldest batch of
+ * samples and of the end of the newest one.  The collector advances tail
+ * before overwriting any data, so readers can tell which part of their copy
+ * is intact.
+ */
+typedef struct
+{
+	uint32				magic;
+	Size				capacity;	/* size of data in bytes */
+	pg_atomic_uint64	tail;
+	pg_atomic_uint64	head;
+	char				data[FLEXIBLE_ARRAY_MEMBER];
+} HistoryRing;
+
+/*
+ * Header of encoded batch of samples taken at once.  Batches are stored
+ * back to back both in the ring and in persisted history files.
+ */
+typedef struct
+{
+	uint32			length;		/* of the whole batch including header */
+	uint32			nitems;
+	TimestampTz		ts;
+} HistoryBatchHeader;
+
+/*
+ * Conditions on samples applied while decoding history.  Zero pid and NULL
+ * names match anything.
+ */
+typedef struct
+{
+	int				pid;
+	bool			hasQueryId;
+	uint64			queryId;
+	const char	   *eventType;
+	const char	   *event;
+	bool			hasSince;
+	TimestampTz		since;
+} HistoryFilter;
+
+/* Batch of samples being encoded by the collector */
+typedef struct HistoryBatch HistoryBatch;
+
+/* Reader of waits history ring by chunks */
+typedef struct HistoryCursor HistoryCursor;
+
+/*
+ * Slot of the waits profile table.  The collector increments changecount
+ * before and after changing the slot, so it is odd while the slot is being
+ * changed and readers have to retry.
+ */
+typedef struct
+{
+	uint32			changecount;
+	bool			used;
+	ProfileItem		item;
+} ProfileSlot;
+
+/*
+ * Waits profile: open-addressing hash table with linear probing, placed in
+ * the main shared memory segment.  The collector is the only writer, while
+ * backends scan it directly.  Entries are never removed except by reset.
+ *
+ * Each profile sampling is a generation.  Entries updated while sampling
+ * generation N + 1 are stamped with N + 1, and the generation counter is
+ * advanced to N + 1 only after that, so all entries stamped up to the
+ * published generation are visible to readers.
+ */
+typedef struct
+{
+	uint32			nslots;		/* power of 2 */
+	uint32			maxEntries;	/* pg_wait_sampling.profile_size */
+	uint32			nentries;
+	uint64			overflow;	/* samples which didn't fit into the table */
+	pg_atomic_uint64 generation;	/* number of completed profile samplings */
+	pg_atomic_uint64 resetGeneration;	/* generation of the last reset */
+	ProfileSlot		slots[FLEXIBLE_ARRAY_MEMBER];
+} ProfileTable;
+
+/*
+ * Histogram of wait durations per (wait event, queryId).  Bucket 0 counts
+ * waits shorter than 2 us, bucket i > 0 counts waits of [2^i, 2^(i+1)) us,
+ * and the last bucket also counts all the longer ones.
+ */
+#define WAIT_HISTOGRAM_BUCKETS	32
+
+typedef struct
+{
+	uint32			wait_event_info;
+	uint64			queryId;
+	uint64			buckets[WAIT_HISTOGRAM_BUCKETS];
+} WaitHistogram;
+
+typedef struct
+{
+	uint32			changecount;
+	bool			used;
+	WaitHistogram	item;
+} WaitHistogramSlot;
+
+/*
+ * Wait duration histograms: hash table of the same kind as waits profile.
+ */
+typedef struct
+{
+	uint32			nslots;		/* power of 2 */
+	uint32			maxEntries;	/* pg_wait_sampling.histogram_size */
+	uint32			nentries;
+	uint64			overflow;	/* waits which didn't fit into the table */
+	WaitHistogramSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} WaitHistogramTable;
+
+/*
+ * Bucket of profile series.  The collector increments changecount before
+ * and after reusing the bucket for the next interval.
+ */
+typedef struct
+{
+	uint32			changecount;
+	TimestampTz		start_ts;	/* 0 if the bucket was never used */
+} SeriesBucket;
+
+/*
+ * Ring of profiles over consecutive time intervals.  The collector rotates
+ * buckets on its own, when a profile sample falls into the next interval.
+ * Profile tables of buckets follow bucket headers.
+ */
+typedef struct
+{
+	int				nbuckets;
+	int				current;
+	int64			resolution;	/* duration of bucket in microseconds */
+	Size			tableSize;
+	Size			tablesOffset;
+	SeriesBucket	buckets[FLEXIBLE_ARRAY_MEMBER];
+} ProfileSeries;
+
+#define pgws_series_table(series, i) \
+	((ProfileTable *) ((char *) (series) + (series)->tablesOffset + \
+					   (series)->tableSize * (i)))
+
+/*
+ * Entry of heavy hitters profile.  item.count is an upper bound of the true
+ * count, which is at least item.count - error.
+ */
+typedef struct
+{
+	uint32			changecount;
+	ProfileItem		item;
+	uint64			error;
+	int32			heapIndex;	/* position in the heap, for collector only */
+} TopNEntry;
+
+/*
+ * Heavy hitters of waits profile tracked by Space-Saving algorithm in fixed
+ * memory: once all entries are taken, a sample of a new key replaces the
+ * entry with minimal count and inherits its count as error.  Entries are
+ * followed by the min-heap of entry numbers ordered by count and by
+ * open-addressing index of entry numbers by key, which only the collector
+ * uses.  Readers scan first nentries entries and retry the ones with odd
+ * or changed changecount, and the whole scan if table changecount changed
+ * because of reset.
+ */
+typedef struct
+{
+	uint32			changecount;
+	uint32			maxEntries;	/* pg_wait_sampling.topn_size */
+	uint32			nentries;
+	uint32			nslots;		/* of index, power of 2 */
+	Size			heapOffset;
+	Size			indexOffset;
+	TopNEntry		entries[FLEXIBLE_ARRAY_MEMBER];
+} TopNTable;
+
+#define pgws_topn_heap(table) \
+	((int32 *) ((char *) (table) + (table)->heapOffset))
+#define pgws_topn_index(table) \
+	((int32 *) ((char *) (table) + (table)->indexOffset))
+
+/*
+ * Dictionary of queryIds met in profile, heavy hitters and series.  The
+ * collector gives queryIds dense ids in order of appearance starting from 1,
+ * and reuses them only after reset of all the tables which may refer to
+ * them.  queryIds[id - 1] is written before nentries is advanced,
+ * so readers resolve any id below nentries.  Every reset advances generation
+ * first, so readers which copied ids before it see they may have been given
+ * to other queryIds since.  The index of ids by queryId follows, which only
+ * the collector uses.  Samples of new queryIds which don't fit into the full
+ * dictionary get id 0, like ones without query.
+ */
+typedef struct
+{
+	uint32			maxEntries;	/* pg_wait_sampling.queryid_dict_size */
+	uint32			nslots;		/* of index, power of 2 */
+	pg_atomic_uint32 nentries;
+	pg_atomic_uint32 generation;
+	uint64			overflow;	/* samples of queryIds which didn't fit */
+	Size			indexOffset;
+	uint64			queryIds[FLEXIBLE_ARRAY_MEMBER];
+} QueryIdDict;
+
+#define pgws_query_dict_index(dict) \
+	((uint32 *) ((char *) (dict) + (dict)->indexOffset))
+
+static inline uint64
+pgws_query_dict_get(QueryIdDict *dict, uint32 id)
+{
+	if (id == 0 || id > pg_atomic_read_u32(&dict->nentries))
+		return 0;
+	pg_read_barrier();
+	return dict->queryIds[id - 1];
+}
+
+/*
+ * Generation of dictionary ids, ordered with reads of ids and queryIds on
+ * both sides.
+ */
+static inline uint32
+pgws_query_dict_generation(QueryIdDict *dict)
+{
+	uint32		generation;
+
+	pg_read_barrier();
+	generation = pg_atomic_read_u32(&dict->generation);
+	pg_read_barrier();
+	return generation;
+}
+
+/*
+ * Map of pids to PGPROC numbers rebuilt by the collector once a second, so
+ * that a process can be found without scanning all PGPROCs.  Open-addressing
+ * hash table of (pid << 32 | procno) values, zero in empty slots.  Entries
+ * may be stale or missing, so readers check the pid of found PGPROC and fall
+ * back to the scan.
+ */
+typedef struct
+{
+	uint32			nslots;		/* power of 2 */
+	pg_atomic_uint64 slots[FLEXIBLE_ARRAY_MEMBER];
+} ProcPidMap;
+
+static inline uint32
+pgws_pid_hash(int pid)
+{
+	return (uint32) pid * 0x9E3779B1;
+}
+
+/*
+ * Set of waits, like the ones excluded from sampling, as bitmap indexed by
+ * class and id of wait event.  Ids which don't fit share the last bit, which
+ * is set only when the whole class is listed.
+ */
+#define WAIT_FILTER_CLASSES		16
+#define WAIT_FILTER_EVENTS		1024
+
+typedef struct
+{
+	uint8			bits[WAIT_FILTER_CLASSES][WAIT_FILTER_EVENTS / 8];
+} WaitFilter;
+
+static inline bool
+pgws_wait_listed(const volatile WaitFilter *filter, uint32 wait_event_info)
+{
+	uint32		classId = (wait_event_info >> 24) & (WAIT_FILTER_CLASSES - 1),
+				eventId = Min(wait_event_info & 0xFFFFFF, WAIT_FILTER_EVENTS - 1);
+
+	return (filter->bits[classId][eventId >> 3] >> (eventId & 7)) & 1;
+}
+
+/* States of high-resolution capture of waits */
+#define CAPTURE_ARMED		0	/* waiting for the trigger to fire */
+#define CAPTURE_ACTIVE		1	/* sampling into capture rings */
+#define CAPTURE_FROZEN		2	/* kept until reset */
+
+/*
+ * Counters of collector's own overhead.  The collector increments
+ * changecount before and after updating them once per probe.  Probe
+ * durations are also counted in log-scaled buckets like wait durations.
+ */
 typedef struct
 {
-	bool			wraparound;
-	Size			index;
-	Size			count;
-	HistoryItem	   *items;
-} History;
+	uint32			changecount;
+	uint64			ticks;			/* probes of waits */
+	uint64			missedTicks;	/* dropped as the collector fell behind */
+	uint64			lagTimeUs;		/* delay of probes after they were due */
+	uint64			lagMaxUs;
+	uint64			probeTimeUs;
+	uint64			probeMaxUs;
+	uint64			probeBuckets[WAIT_HISTOGRAM_BUCKETS];
+	uint64			lockTimeUs;		/* ProcArrayLock held by probes */
+	uint64			historyWritten;	/* bytes ever written to the ring */
+	uint64			historyOverwritten;	/* bytes dropped to make room */
+	Size			historyCapacity;
+} CollectorStats;
 
-typedef enum
+/*
+ * State of collector shard.  With pg_wait_sampling.collectors > 1, shard n
+ * samples PGPROCs whose numbers are n modulo the number of shards, and has
+ * its own history ring and stats.
+ */
+typedef struct
 {
-	NO_REQUEST,
-	HISTORY_REQUEST,
-	PROFILE_REQUEST,
-	PROFILE_RESET
-} SHMRequest;
+	dsm_handle		historyHandle;
+	HistoryRing	   *shmemHistory;	/* preallocated history ring, or NULL */
+	HistoryRing	   *captureRing;	/* NULL if capture is disabled */
+	CollectorStats	stats;
+} CollectorShard;
 
 typedef struct
 {
-	Latch		   *latch;
-	SHMRequest		request;
 	int				historySize;
-	int				historyPeriod;
-	int				profilePeriod;
+	double			historyPeriod;	/* in milliseconds */
+	double			profilePeriod;	/* in milliseconds */
 	bool			profilePid;
 	bool			profileQueries;
-} CollectorShmqHeader;
+	bool			profileDatabase;
+	bool			profileRole;
+	bool			profileBackendType;
+	pg_atomic_uint64 reads;			/* snapshots taken by readers */
+	pg_atomic_uint64 readRetries;	/* re-reads of entries being changed */
+	bool			locklessSampling;
+	bool			adaptiveSampling;
+	int				adaptiveThreshold;
+	int				adaptiveWaitClass;	/* PG_WAIT_* or 0 for all waits */
+	bool			lockBlockers;
+	int				lockBlockersPeriod;	/* in milliseconds */
+
+	/*
+	 * Compiled pg_wait_sampling.include_waits, exclude_waits and
+	 * exclude_backend_types.  Only the postmaster writes them on
+	 * configuration reload.
+	 */
+	WaitFilter		waitFilter;
+	uint32			excludedBackendTypes;	/* bitmask of 1 << PGWS_BACKEND_* */
+
+	/*
+	 * High-resolution capture.  Once captureThreshold sampled processes of a
+	 * shard wait in captureWaits, shards sample every capturePeriod into
+	 * their capture rings for captureDuration, and the rings are frozen
+	 * then.  captureWaits and captureEnabled are written by the postmaster
+	 * like sampling filters.  State and trigger details change under
+	 * aggregateLock.
+	 */
+	WaitFilter		captureWaits;
+	bool			captureEnabled;	/* pg_wait_sampling.capture_waits is set */
+	int				captureThreshold;
+	double			capturePeriod;	/* in milliseconds */
+	int				captureDuration;	/* in milliseconds */
+	int				captureState;	/* CAPTURE_* */
+	TimestampTz		captureStart;
+	TimestampTz		captureEnd;
+	uint32			captureEvent;	/* wait which fired the trigger */
+	int				captureWaiting;	/* processes which were seen in them */
+
+	/*
+	 * Collector shards update profile, histograms, heavy hitters and series
+	 * under aggregateLock, and backends reset them under it too.  Capture
+	 * rings are written and reset under aggregateLock as well.
+	 */
+	LWLock		   *aggregateLock;
+	int				nshards;
+	CollectorShard	shards[FLEXIBLE_ARRAY_MEMBER];
+} CollectorSharedState;
+
+/* Reader of persisted waits history */
+typedef struct PersistReader PersistReader;
 
 /* pg_wait_sampling.c */
-extern CollectorShmqHeader *pgws_collector_hdr;
-extern shm_mq			   *pgws_collector_mq;
+extern CollectorSharedState *pgws_collector_hdr;
+extern ProfileTable		   *pgws_profile_table;
+extern WaitHistogramTable  *pgws_histogram_table;
+extern ProfileSeries	   *pgws_profile_series;
+extern TopNTable		   *pgws_topn_table;
 extern uint64			   *pgws_proc_queryids;
-extern void pgws_init_lock_tag(LOCKTAG *tag, uint32 lock);
+extern ProcPidMap		   *pgws_proc_pids;
+extern QueryIdDict		   *pgws_query_dict;
+extern bool					pgws_persist_history;
+extern int					pgws_persist_flush_period;
+extern int					pgws_persist_segment_size;
+extern int					pgws_persist_segments;
+
+/* history.c */
+extern Size pgws_history_ring_size(Size capacity);
+extern void pgws_history_init(HistoryRing *ring, Size capacity);
+extern uint64 pgws_history_copy_chunk(HistoryRing *dst, HistoryRing *src,
+									  uint64 from, Size maxBytes);
+extern HistoryBatch *pgws_history_batch_create(int maxItems);
+extern void pgws_history_batch_begin(HistoryBatch *batch, TimestampTz ts,
+									 Size capacity);
+extern bool pgws_history_batch_add(HistoryBatch *batch, const HistoryItem *item);
+extern void pgws_history_append(HistoryRing *ring, HistoryBatch *batch);
+extern bool pgws_history_append_no_evict(HistoryRing *ring, HistoryBatch *batch);
+extern uint64 pgws_history_seek(HistoryRing *ring, uint64 from,
+							   TimestampTz ts);
+extern char *pgws_history_read_raw(HistoryRing *ring, uint64 from,
+								   uint64 *next, Size *len);
+extern HistoryItem *pgws_history_decode(const char *buf, Size len,
+										const HistoryFilter *filter, Size *count);
+extern HistoryCursor *pgws_history_cursor_open(HistoryRing *ring,
+											   const HistoryFilter *filter,
+											   Size chunkSize);
+extern HistoryItem *pgws_history_cursor_next(HistoryCursor *cursor);
+extern void pgws_history_cursor_close(HistoryCursor *cursor);
 
 /* collector.c */
-extern void pgws_register_wait_collector(void);
+extern void pgws_register_wait_collector(int shardno);
 extern PGDLLEXPORT void pgws_collector_main(Datum main_arg);
+extern void pgws_reset_profile(void);
+extern void pgws_reset_capture(void);
+
+/* persist.c */
+extern void pgws_register_flusher(void);
+extern PGDLLEXPORT void pgws_flusher_main(Datum main_arg);
+extern PersistReader *pgws_persist_begin_read(TimestampTz from, TimestampTz to);
+extern HistoryItem *pgws_persist_read_next(PersistReader *reader, Size *count);
+extern void pgws_persist_end_read(PersistReader *reader);
 
 #endif
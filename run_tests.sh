@@ -48,8 +48,8 @@ make USE_PGXS=1 install
 status=$?
 if [ $status -ne 0 ]; then exit $status; fi
 
-# add pg_wait_sampling to shared_preload_libraries and restart cluster 'test'
-echo "shared_preload_libraries = 'pg_wait_sampling'" >> $PGDATA/postgresql.conf
+# add pg_wait_sampling settings of regression tests and restart cluster 'test'
+cat conf.add >> $PGDATA/postgresql.conf
 echo "port = 55435" >> $PGDATA/postgresql.conf
 pg_ctl start -l /tmp/postgres.log -w
 
@@ -64,4 +64,12 @@ PGPORT=55435 make USE_PGXS=1 installcheck || status=$?
 # show diff if it exists
 if test -f regression.diffs; then cat regression.diffs; fi
 
+# restart cluster 'test' with several collectors, persisted history, heavy
+# hitters and capture of waits and run regression tests of them
+cat conf_sharded.add >> $PGDATA/postgresql.conf
+pg_ctl restart -l /tmp/postgres.log -w
+PGPORT=55435 make USE_PGXS=1 installcheck REGRESS_CONFIG=sharded || status=$?
+
+if test -f regression.diffs; then cat regression.diffs; fi
+
 exit $status
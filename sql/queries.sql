@@ -13,6 +13,207 @@ WITH t as (SELECT sum(0) FROM pg_wait_sampling_profile)
 SELECT count(*) = 1 as test FROM pg_wait_sampling_get_current(pg_backend_pid());
 SELECT count(*) >= 0 as test FROM pg_wait_sampling_get_profile();
 SELECT count(*) >= 0 as test FROM pg_wait_sampling_get_history();
+SELECT generation >= reset_generation as test FROM pg_wait_sampling_get_profile_generation();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_lock_history() WHERE pid = pg_backend_pid();
+SELECT count(*) = 1 as test FROM pg_wait_sampling_get_collector_stats();
+SELECT state = 'disabled' as test FROM pg_wait_sampling_get_capture_state();
+
+-- Filtered history matches wait events case-insensitively
+SELECT clock_timestamp() AS filtered_start \gset
+SELECT pg_sleep(0.2);
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_history_filtered(pid => pg_backend_pid(),
+	event_type => 'timeout', event => 'pgsleep', since => :'filtered_start');
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_history_filtered(pid => pg_backend_pid(),
+	event => 'NoSuchEvent');
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_history_filtered(since => now() + interval '1 hour');
+
+-- Sampling filters are set only in configuration and applied on reload
+SET pg_wait_sampling.exclude_waits = 'Timeout';
+ALTER SYSTEM SET pg_wait_sampling.exclude_waits = 'NoSuchType';
+ALTER SYSTEM SET pg_wait_sampling.exclude_waits = 'Timeout:NoSuchEvent';
+ALTER SYSTEM SET pg_wait_sampling.exclude_waits = 'Timeout:PgSleep';
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.2);
+SELECT clock_timestamp() AS filter_start \gset
+SELECT pg_sleep(0.2);
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_history()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep' AND ts >= :'filter_start';
+ALTER SYSTEM RESET pg_wait_sampling.exclude_waits;
+SELECT pg_reload_conf();
+
+-- Sub-millisecond periods keep profiling and the collector on schedule
+SET pg_wait_sampling.profile_period = 0.15;
+SET pg_wait_sampling.adaptive_sampling = on;
+SET pg_wait_sampling.adaptive_threshold = 1;
+SET pg_wait_sampling.adaptive_wait_class = 'timeout';
+SELECT pg_sleep(0.2);
+SELECT coalesce(sum(count), 0) AS sleep_count
+	FROM pg_wait_sampling_get_profile()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep' \gset
+SELECT pg_sleep(0.5);
+SELECT sum(count) > :sleep_count as test FROM pg_wait_sampling_get_profile()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+SELECT ticks AS old_ticks, missed_ticks AS old_missed, tick_lag_us AS old_lag
+	FROM pg_wait_sampling_get_collector_stats() \gset
+SELECT pg_sleep(0.2);
+SELECT ticks > :old_ticks AND missed_ticks >= :old_missed AND tick_lag_us >= :old_lag
+	AND tick_lag_max_us BETWEEN 0 AND tick_lag_us as test
+	FROM pg_wait_sampling_get_collector_stats();
+RESET pg_wait_sampling.adaptive_wait_class;
+RESET pg_wait_sampling.adaptive_threshold;
+RESET pg_wait_sampling.adaptive_sampling;
+RESET pg_wait_sampling.profile_period;
+
+-- History ring is resized on the fly and keeps its counters
+SELECT history_written_bytes AS old_written FROM pg_wait_sampling_get_collector_stats() \gset
+SET pg_wait_sampling.history_size = 1000;
+SHOW pg_wait_sampling.history_size;
+DO $$
+BEGIN
+	FOR i IN 1..100 LOOP
+		EXIT WHEN (SELECT history_bytes FROM pg_wait_sampling_get_collector_stats()) =
+			1000 * 24 * current_setting('pg_wait_sampling.collectors')::int;
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END
+$$;
+SELECT history_bytes = 1000 * 24 * current_setting('pg_wait_sampling.collectors')::int
+	AND history_written_bytes >= :old_written
+	AND history_written_bytes - history_overwritten_bytes <= history_bytes as test
+	FROM pg_wait_sampling_get_collector_stats();
+RESET pg_wait_sampling.history_size;
+
+-- Lockless sampling sees waits without taking ProcArrayLock
+SET pg_wait_sampling.lockless_sampling = on;
+SELECT pg_sleep(0.1);
+SELECT procarray_lock_us AS lock_us, clock_timestamp() AS lockless_start
+	FROM pg_wait_sampling_get_collector_stats() \gset
+SELECT pg_sleep(0.2);
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_history()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep' AND ts >= :'lockless_start';
+SELECT procarray_lock_us = :lock_us as test FROM pg_wait_sampling_get_collector_stats();
+RESET pg_wait_sampling.lockless_sampling;
+
+-- Delta profile returns only entries updated after given generation
+SELECT generation - 1 AS delta_since FROM pg_wait_sampling_get_profile_generation() \gset
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_delta(:delta_since)
+	WHERE generation <= :delta_since;
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_delta(:delta_since + 1000000);
+
+-- Finished waits are counted in non-empty log-scaled buckets
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_wait_histogram()
+	WHERE event = 'PgSleep' AND lower_us >= 65536;
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_wait_histogram()
+	WHERE count <= 0 OR (lower_us > 0 AND upper_us <> 2 * lower_us);
+
+-- Adaptive threshold is at least one waiting process
+SET pg_wait_sampling.adaptive_threshold = 0;
+
+-- Adaptive sampling keeps profiling while nothing waits in the watched class
+SET pg_wait_sampling.adaptive_threshold = 1;
+SET pg_wait_sampling.adaptive_sampling = on;
+SET pg_wait_sampling.adaptive_wait_class = 'lock';
+SELECT pg_sleep(0.1);
+SELECT coalesce(sum(count), 0) AS idle_count, clock_timestamp() AS idle_start
+	FROM pg_wait_sampling_get_profile()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep' \gset
+SELECT pg_sleep(0.5);
+SELECT sum(count) > :idle_count as test FROM pg_wait_sampling_get_profile()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_history()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep' AND ts >= :'idle_start';
+RESET pg_wait_sampling.adaptive_wait_class;
+RESET pg_wait_sampling.adaptive_sampling;
+RESET pg_wait_sampling.adaptive_threshold;
+
+-- Series buckets start on multiples of resolution within the range
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_series(now() - interval '1 hour', clock_timestamp())
+	WHERE extract(epoch FROM bucket_ts)::int8 % 60 <> 0 OR bucket_ts > clock_timestamp();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_series(clock_timestamp() + interval '1 hour',
+	clock_timestamp() + interval '2 hours');
+
+-- Raw history resolves through the wait events dictionary
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_history_raw() r
+	JOIN pg_wait_sampling_get_wait_events() e USING (wait_event_info)
+	WHERE r.pid = pg_backend_pid() AND e.event_type = 'Timeout' AND e.event = 'PgSleep';
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_history_raw() r
+	WHERE r.pid = pg_backend_pid() AND NOT EXISTS (
+		SELECT 1 FROM pg_wait_sampling_get_wait_events() e
+			WHERE e.wait_event_info = r.wait_event_info);
+SELECT count(*) = count(DISTINCT wait_event_info) as test FROM pg_wait_sampling_get_wait_events();
+
+-- Current wait has queryId of the nested statement, not of the top one
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 140000 THEN
+		PERFORM set_config('compute_query_id', 'on', false);
+	END IF;
+END
+$$;
+DO $$
+DECLARE
+	nested int8;
+	top int8;
+BEGIN
+	IF current_setting('server_version_num')::int < 140000 THEN
+		RETURN;
+	END IF;
+	SELECT queryid INTO nested FROM pg_wait_sampling_get_current(pg_backend_pid());
+	EXECUTE 'SELECT query_id FROM pg_stat_activity WHERE pid = pg_backend_pid()' INTO top;
+	IF nested = 0 OR top IS NULL OR nested = top THEN
+		RAISE EXCEPTION 'nested queryId % is not tracked, top one is %', nested, top;
+	END IF;
+	EXECUTE 'RESET compute_query_id';
+END
+$$;
+
+-- Extended profile fills in only turned on dimensions
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_extended()
+	WHERE datid IS NOT NULL OR roleid IS NOT NULL OR backend_type IS NOT NULL;
+SET pg_wait_sampling.profile_backend_type = on;
+SELECT pg_sleep(0.2);
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_profile_extended()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep' AND backend_type = 'backend'
+	AND datid IS NULL AND roleid IS NULL;
+RESET pg_wait_sampling.profile_backend_type;
+
+-- Current waits of listed pids skip unknown and NULL pids
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_current_pids(ARRAY[-1]);
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_current_pids(ARRAY[NULL]::int4[]);
+SELECT count(*) = 1 as test FROM pg_wait_sampling_get_current_pids(ARRAY[pg_backend_pid(), -1, NULL]);
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_current_pids(ARRAY[pg_backend_pid()])
+	WHERE pid <> pg_backend_pid();
+
+-- Reset empties profile and series at once
+SELECT pg_sleep(0.2);
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_profile_series(now() - interval '1 hour', clock_timestamp())
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
 SELECT pg_wait_sampling_reset_profile();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_series(now() - interval '1 hour', clock_timestamp())
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+
+-- QueryId dictionary is cleared on reset and reports its use in stats
+SELECT pg_sleep(0.1);
+SELECT queryid_dict_entries = (SELECT count(*) FROM pg_wait_sampling_get_queryids())
+	AND queryid_dict_overflow = 0 as test
+	FROM pg_wait_sampling_get_collector_stats();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_queryids()
+	WHERE id <= 0 OR queryid = 0;
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile() p
+	WHERE queryid <> 0 AND NOT EXISTS (
+		SELECT 1 FROM pg_wait_sampling_get_queryids() q WHERE q.queryid = p.queryid);
+
+-- Capture stays empty while disabled and only superusers may re-arm it
+SELECT state = 'disabled' as test FROM pg_wait_sampling_get_capture_state();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_capture();
+CREATE ROLE regress_pgws_user;
+SET ROLE regress_pgws_user;
+SELECT pg_wait_sampling_reset_capture();
+RESET ROLE;
+DROP ROLE regress_pgws_user;
+
+SELECT pg_wait_sampling_reset_capture();
 
 DROP EXTENSION pg_wait_sampling;
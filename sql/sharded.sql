@@ -0,0 +1,67 @@
+CREATE EXTENSION pg_wait_sampling;
+
+-- History rings of all the collectors are merged in time order
+SELECT pg_sleep(0.5);
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_history()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+SELECT count(*) = 0 as test FROM (
+	SELECT ts < lag(ts) OVER () AS unordered FROM pg_wait_sampling_get_history()
+) h WHERE unordered;
+
+-- Persisted history keeps samples of every collector within a window
+SELECT clock_timestamp() AS window_start \gset
+SELECT pg_sleep(0.5);
+SELECT clock_timestamp() AS window_end \gset
+SELECT pg_sleep(0.5);
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_history()
+	WHERE ts BETWEEN :'window_start' AND :'window_end';
+SELECT count(*) = 0 as test FROM (
+	SELECT pid, ts FROM pg_wait_sampling_get_history()
+		WHERE ts BETWEEN :'window_start' AND :'window_end'
+	EXCEPT
+	SELECT pid, ts FROM pg_wait_sampling_get_persisted_history(:'window_start', :'window_end')
+) lost;
+SELECT count(*) = 0 as test FROM (
+	SELECT ts < lag(ts) OVER () AS unordered
+		FROM pg_wait_sampling_get_persisted_history(:'window_start', :'window_end')
+) h WHERE unordered;
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_persisted_history(
+	clock_timestamp() + interval '1 hour', clock_timestamp() + interval '2 hours');
+
+-- Heavy hitters keep their bound and error consistent
+SELECT pg_sleep(0.2);
+SELECT count(*) <= 64 as test FROM pg_wait_sampling_get_profile_topn();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_topn()
+	WHERE count < error;
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_profile_topn()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+
+-- Reset empties heavy hitters too
+SELECT pg_wait_sampling_reset_profile();
+SELECT count(*) = 0 as test FROM pg_wait_sampling_get_profile_topn()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+
+-- Small capture ring is frozen once full, while history keeps every sample
+SET pg_wait_sampling.capture_threshold = 1;
+ALTER SYSTEM SET pg_wait_sampling.capture_waits = 'Timeout:PgSleep';
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.5);
+SELECT state = 'frozen' AND end_ts < start_ts + interval '1 second' as test
+	FROM pg_wait_sampling_get_capture_state();
+SELECT count(*) > 0 as test FROM pg_wait_sampling_get_capture()
+	WHERE pid = pg_backend_pid() AND event = 'PgSleep';
+SELECT count(*) = 0 as test FROM (
+	SELECT pid, ts FROM pg_wait_sampling_get_capture()
+		WHERE ts IN (SELECT ts FROM pg_wait_sampling_get_history())
+	EXCEPT
+	SELECT pid, ts FROM pg_wait_sampling_get_history()
+) lost;
+SELECT count(*) > 0 as test
+	FROM pg_wait_sampling_get_history() h, pg_wait_sampling_get_capture_state() s
+	WHERE h.pid = pg_backend_pid() AND h.event = 'PgSleep' AND h.ts > s.end_ts;
+ALTER SYSTEM RESET pg_wait_sampling.capture_waits;
+SELECT pg_reload_conf();
+RESET pg_wait_sampling.capture_threshold;
+SELECT pg_wait_sampling_reset_capture();
+
+DROP EXTENSION pg_wait_sampling;